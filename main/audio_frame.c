@@ -0,0 +1,188 @@
+/* MPEG audio Layer III / AAC ADTS frame parser
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include <inttypes.h>
+#include "esp_log.h"
+
+#include "vs1053.h"
+#include "audio_frame.h"
+
+static const char *TAG = "FRAME";
+
+// Layer III bitrates [kbit/s], MPEG-1 and MPEG-2/2.5
+static const uint16_t mp3_bitrate[2][16] = {
+	{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 },
+	{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 },
+};
+
+static const uint32_t mp3_sample_rate[3] = { 44100, 48000, 32000 };
+
+static const uint32_t adts_sample_rate[13] = {
+	96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+
+// Returns the frame length, or 0 if h isn't a frame header.
+static size_t frame_header(const uint8_t *h, uint8_t *format, uint32_t *samples, uint32_t *sampleRate, uint32_t *bitrate) {
+	if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0) return 0;
+
+	if ((h[1] & 0xF6) == 0xF0) {
+		// ADTS: 12 bit sync, layer 00
+		uint8_t index = (h[2] >> 2) & 0x0F;
+		if (index >= 13) return 0;
+		size_t length = ((h[3] & 0x03) << 11) | (h[4] << 3) | (h[5] >> 5);
+		if (length < FRAME_HEADER_SIZE) return 0;
+		*format = VS1053_FORMAT_AAC;
+		*sampleRate = adts_sample_rate[index];
+		*samples = 1024 * ((h[6] & 0x03) + 1);
+		*bitrate = (uint64_t)length * 8 * *sampleRate / *samples / 1000;
+		return length;
+	}
+
+	// MPEG audio: 11 bit sync, version 1 / 2 / 2.5, Layer III only
+	uint8_t version = (h[1] >> 3) & 0x03; // 3:MPEG-1 2:MPEG-2 0:MPEG-2.5
+	if (version == 1) return 0;
+	if (((h[1] >> 1) & 0x03) != 1) return 0;
+	uint8_t bitrateIndex = h[2] >> 4;
+	uint8_t rateIndex = (h[2] >> 2) & 0x03;
+	if (bitrateIndex == 0 || bitrateIndex == 15 || rateIndex == 3) return 0; // Free format isn't supported
+	bool mpeg1 = (version == 3);
+	*format = VS1053_FORMAT_MP3;
+	*bitrate = mp3_bitrate[mpeg1 ? 0 : 1][bitrateIndex];
+	*sampleRate = mp3_sample_rate[rateIndex] >> (mpeg1 ? 0 : (version == 2 ? 1 : 2));
+	*samples = mpeg1 ? 1152 : 576;
+	return (mpeg1 ? 144 : 72) * *bitrate * 1000 / *sampleRate + ((h[2] >> 1) & 0x01);
+}
+
+void frameReset(AUDIO_FRAME_t * frame) {
+	memset(frame, 0, sizeof(AUDIO_FRAME_t));
+	frame->format = VS1053_FORMAT_NONE;
+}
+
+/**
+ * Follow the frames in the next block of the stream.
+ *
+ * Junk in front of the first frame (e.g. an ID3 tag or the rest of a frame
+ * after reconnecting) should not be sent to the VS1053, so data is edited in
+ * place and the new length is returned. A header found in junk can be a false
+ * sync, so the first frame is only trusted when the next header follows at its
+ * frame length. That first frame is dropped with the junk.
+ * Header bytes of the trusted frame that came in earlier blocks were dropped
+ * there, and are put back in front of data. size is the room in data for this.
+ */
+size_t frameParse(AUDIO_FRAME_t * frame, uint8_t *data, size_t length, size_t size) {
+	size_t keep = frame->started ? 0 : length; // Start of the data to keep
+	uint8_t carry[FRAME_HEADER_SIZE];
+	size_t carryLength = 0;
+	size_t i = 0;
+	while (i < length) {
+		if (frame->skip) {
+			size_t n = length - i;
+			if (n > frame->skip) n = frame->skip;
+			frame->skip -= n;
+			i += n;
+			continue;
+		}
+
+		if (frame->headerLength == 0 && !frame->synced) {
+			// Look for the next sync byte
+			const uint8_t *sp = memchr(&data[i], 0xFF, length - i);
+			size_t n = (sp == NULL) ? length - i : (size_t)(sp - &data[i]);
+			frame->junk += n;
+			i += n;
+			if (sp == NULL) break;
+		}
+
+		size_t n = FRAME_HEADER_SIZE - frame->headerLength;
+		if (n > length - i) n = length - i;
+		memcpy(&frame->header[frame->headerLength], &data[i], n);
+		frame->headerLength += n;
+		i += n;
+		if (frame->headerLength < FRAME_HEADER_SIZE) break;
+
+		uint8_t format;
+		uint32_t samples, sampleRate, bitrate;
+		size_t frameLength = frame_header(frame->header, &format, &samples, &sampleRate, &bitrate);
+		// While in sync, the next header must continue the same stream
+		if (frameLength && (frame->started || frame->synced) && format != frame->format) frameLength = 0;
+		if (frameLength && frame->synced && sampleRate != frame->sampleRate) frameLength = 0;
+		if (frameLength >= FRAME_HEADER_SIZE) {
+			if (!frame->started) {
+				// The header starts this many bytes before the block when negative
+				long start = (long)i - FRAME_HEADER_SIZE;
+				if (!frame->synced || (start < 0 && length + (size_t)-start > size)) {
+					// Not confirmed yet (or no room to put the header back):
+					// drop this frame and check the next header
+					frame->format = format;
+					frame->synced = true;
+					frame->sampleRate = sampleRate;
+					frame->junk += frameLength;
+					frame->skip = frameLength - FRAME_HEADER_SIZE;
+					frame->headerLength = 0;
+					continue;
+				}
+				ESP_LOGI(TAG, "First frame format=%d sampleRate=%"PRIu32" bitrate=%"PRIu32" after %"PRIu32" bytes",
+					format, sampleRate, bitrate, frame->junk);
+				frame->started = true;
+				if (start >= 0) {
+					keep = start;
+				} else {
+					keep = 0;
+					carryLength = -start;
+					memcpy(carry, frame->header, carryLength);
+				}
+			}
+			frame->format = format;
+			frame->synced = true;
+			frame->sampleRate = sampleRate;
+			frame->bitrate = bitrate;
+			frame->frames++;
+			frame->durationUs += (uint64_t)samples * 1000000 / sampleRate;
+			frame->bytes += frameLength;
+			frame->skip = frameLength - FRAME_HEADER_SIZE;
+			frame->headerLength = 0;
+			continue;
+		}
+
+		// Not a frame header. Search again from the next sync byte in the header.
+		if (frame->synced) {
+			frame->synced = false;
+			if (frame->started) {
+				frame->resyncs++;
+				ESP_LOGD(TAG, "Lost sync after %"PRIu32" frames", frame->frames);
+			}
+		}
+		const uint8_t *sp = memchr(&frame->header[1], 0xFF, frame->headerLength - 1);
+		n = (sp == NULL) ? frame->headerLength : (size_t)(sp - frame->header);
+		frame->junk += n;
+		frame->headerLength -= n;
+		memmove(frame->header, &frame->header[n], frame->headerLength);
+	}
+
+	if (carryLength) {
+		memmove(&data[carryLength], data, length);
+		memcpy(data, carry, carryLength);
+		return length + carryLength;
+	}
+	memmove(data, &data[keep], length - keep);
+	return length - keep;
+}
+
+uint32_t frameAverageBitrate(AUDIO_FRAME_t * frame) {
+	if (frame->durationUs == 0) return 0;
+	return frame->bytes * 8 * 1000 / frame->durationUs;
+}
+
+// MP3 and ADTS streams resync on every frame header, so a track of the same
+// format can follow without ending the previous one. Everything else needs
+// the endFillByte / SM_CANCEL sequence.
+bool frameConcatenable(uint8_t prev, uint8_t next) {
+	if (prev != next) return false;
+	return (next == VS1053_FORMAT_MP3 || next == VS1053_FORMAT_AAC);
+}
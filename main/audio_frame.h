@@ -0,0 +1,44 @@
+/* MPEG audio Layer III / AAC ADTS frame parser
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef MAIN_AUDIO_FRAME_H_
+#define MAIN_AUDIO_FRAME_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define FRAME_HEADER_SIZE 7                 // ADTS fixed + variable header
+
+// The parser follows the stream from frame header to frame header, so only
+// the header bytes are looked at.
+typedef struct {
+	uint8_t format;                         // VS1053_FORMAT_MP3 / VS1053_FORMAT_AAC
+	bool started;                           // A confirmed frame has been found since frameReset()
+	bool synced;                            // The last header was valid (not confirmed yet without started)
+	size_t skip;                            // Bytes left in the current frame
+	uint8_t header[FRAME_HEADER_SIZE];      // Header, may span several blocks
+	size_t headerLength;
+	uint32_t sampleRate;                    // Of the last frame
+	uint32_t bitrate;                       // Of the last frame [kbit/s]
+	uint32_t frames;                        // Number of frames
+	uint64_t durationUs;                    // Duration of the frames
+	uint64_t bytes;                         // Bytes in the frames
+	uint32_t junk;                          // Bytes outside frames
+	uint32_t resyncs;                       // Number of times sync was lost
+} AUDIO_FRAME_t;
+
+void frameReset(AUDIO_FRAME_t * frame);
+size_t frameParse(AUDIO_FRAME_t * frame, uint8_t *data, size_t length, size_t size); // Drops the junk in front
+                                                            // of the first frame. Returns the new length.
+uint32_t frameAverageBitrate(AUDIO_FRAME_t * frame);       // kbit/s
+bool frameConcatenable(uint8_t prev, uint8_t next);         // A track of format next can follow
+                                                            // prev without ending it
+
+#endif /* MAIN_AUDIO_FRAME_H_ */
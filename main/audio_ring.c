@@ -0,0 +1,250 @@
+/* Single producer / single consumer audio ring buffer
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include <inttypes.h>
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include "audio_ring.h"
+
+static const char *TAG = "RING";
+
+bool ringInit(AUDIO_RING_t * ring, size_t size, uint32_t caps) {
+	ring->buffer = heap_caps_malloc(size, caps);
+	if (ring->buffer == NULL) {
+		ESP_LOGE(TAG, "Cannot malloc %d bytes", size);
+		return false;
+	}
+	ring->size = size;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	ring->headOffset = 0;
+	ring->tailOffset = 0;
+	ring->byteRate = 128 * 1000 / 8;	// Until the stream tells its bitrate
+	ring->refillMs = 2000;
+	ringSetRefill(ring, ring->refillMs);
+	atomic_init(&ring->producerWaiting, false);
+	atomic_init(&ring->consumerWaiting, false);
+	atomic_init(&ring->discard, false);
+	atomic_init(&ring->discardHead, 0);
+	atomic_init(&ring->wake, false);
+	atomic_init(&ring->producerWake, false);
+	ring->spaceReady = xSemaphoreCreateBinary();
+	ring->dataReady = xSemaphoreCreateBinary();
+	ring->producerWaits = 0;
+	configASSERT( ring->spaceReady );
+	configASSERT( ring->dataReady );
+	return true;
+}
+
+// The producer sleeps when less than one receive block is free, and wakes
+// when refillMs of audio has been played.
+void ringSetRefill(AUDIO_RING_t * ring, uint32_t refillMs) {
+	ring->refillMs = refillMs;
+	ring->highWater = ring->size - 4096;
+	size_t refill = ringBytes(ring, refillMs);
+	if (refill > ring->highWater / 2) refill = ring->highWater / 2;
+	ring->lowWater = ring->highWater - refill;
+	ESP_LOGI(TAG, "size=%d highWater=%d lowWater=%d (%"PRIu32" ms)", ring->size, ring->highWater, ring->lowWater, refillMs);
+}
+
+void ringSetBitrate(AUDIO_RING_t * ring, uint32_t kbps) {
+	if (kbps == 0) return;
+	ring->byteRate = kbps * 1000 / 8;
+	ringSetRefill(ring, ring->refillMs);
+}
+
+size_t ringBytes(AUDIO_RING_t * ring, uint32_t ms) {
+	return (uint64_t)ring->byteRate * ms / 1000;
+}
+
+uint32_t ringFillMs(AUDIO_RING_t * ring) {
+	return (uint64_t)ringFill(ring) * 1000 / ring->byteRate;
+}
+
+// The feeder copies the ring 32 bytes at a time into the DMA-capable SDI
+// buffer. From PSRAM, most of these copies miss the cache.
+void ringMeasureCopy(AUDIO_RING_t * ring) {
+	uint8_t *burst = heap_caps_malloc(32, MALLOC_CAP_DMA);
+	uint8_t *local = heap_caps_malloc(4096, MALLOC_CAP_INTERNAL);
+	if (burst == NULL || local == NULL) goto finish;
+
+	size_t length = ring->size;
+	if (length > 256 * 1024) length = 256 * 1024; // Larger than the cache
+	int64_t start = esp_timer_get_time();
+	for (size_t offset = 0; offset + 32 <= length; offset += 32) {
+		memcpy(burst, &ring->buffer[offset], 32);
+	}
+	int64_t ringUs = esp_timer_get_time() - start;
+
+	start = esp_timer_get_time();
+	for (size_t offset = 0; offset + 32 <= length; offset += 32) {
+		memcpy(burst, &local[offset % 4096], 32);
+	}
+	int64_t localUs = esp_timer_get_time() - start;
+	ESP_LOGI(TAG, "32 byte copies: ring %lld us/MB, internal RAM %lld us/MB",
+		ringUs * 1024 * 1024 / length, localUs * 1024 * 1024 / length);
+
+finish:
+	free(burst);
+	free(local);
+}
+
+size_t ringFill(AUDIO_RING_t * ring) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	return head - tail;
+}
+
+// Producer side
+
+// head and tail wrap around at SIZE_MAX, which is not a multiple of size,
+// so the positions in buffer are kept apart from them.
+size_t ringWriteSpan(AUDIO_RING_t * ring, uint8_t **span) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t offset = ring->headOffset;
+	size_t length = ring->size - (head - tail);
+	if (length > ring->size - offset) length = ring->size - offset;
+	*span = &ring->buffer[offset];
+	return length;
+}
+
+void ringCommit(AUDIO_RING_t * ring, size_t length) {
+	ring->headOffset = (ring->headOffset + length) % ring->size;
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	atomic_store_explicit(&ring->head, head + length, memory_order_release);
+	// Pairs with the fence in ringWaitData()
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&ring->consumerWaiting, memory_order_relaxed)) {
+		atomic_store_explicit(&ring->consumerWaiting, false, memory_order_relaxed);
+		xSemaphoreGive(ring->dataReady);
+	}
+}
+
+// Returns false when ringWakeProducer() ended the wait early
+bool ringWaitSpace(AUDIO_RING_t * ring) {
+	if (ringFill(ring) <= ring->highWater) return true;
+	ring->producerWaits++;
+	bool ready = true;
+	while (1) {
+		atomic_store_explicit(&ring->producerWaiting, true, memory_order_relaxed);
+		// The consumer may have drained the ring before it saw the flag
+		atomic_thread_fence(memory_order_seq_cst);
+		if (ringFill(ring) <= ring->lowWater) break;
+		if (atomic_exchange_explicit(&ring->producerWake, false, memory_order_acquire)) {
+			ready = false;
+			break;
+		}
+		xSemaphoreTake(ring->spaceReady, portMAX_DELAY);
+	}
+	atomic_store_explicit(&ring->producerWaiting, false, memory_order_relaxed);
+	return ready;
+}
+
+// Consumer side
+
+size_t ringReadSpan(AUDIO_RING_t * ring, uint8_t **span) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t offset = ring->tailOffset;
+	size_t length = head - tail;
+	if (length > ring->size - offset) length = ring->size - offset;
+	*span = &ring->buffer[offset];
+	return length;
+}
+
+void ringRelease(AUDIO_RING_t * ring, size_t length) {
+	ring->tailOffset = (ring->tailOffset + length) % ring->size;
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	atomic_store_explicit(&ring->tail, tail + length, memory_order_release);
+	// Pairs with the fence in ringWaitSpace()
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&ring->producerWaiting, memory_order_relaxed)) {
+		if (ringFill(ring) <= ring->lowWater) {
+			atomic_store_explicit(&ring->producerWaiting, false, memory_order_relaxed);
+			xSemaphoreGive(ring->spaceReady);
+		}
+	}
+}
+
+bool ringWaitData(AUDIO_RING_t * ring, size_t length, TickType_t xTicksToWait) {
+	bool ready = true;
+	TimeOut_t xTimeOut;
+	vTaskSetTimeOutState(&xTimeOut);
+	while (1) {
+		atomic_store_explicit(&ring->consumerWaiting, true, memory_order_relaxed);
+		// The producer may have committed before it saw the flag
+		atomic_thread_fence(memory_order_seq_cst);
+		if (ringFill(ring) >= length) break;
+		if (atomic_load_explicit(&ring->discard, memory_order_acquire)) break;
+		if (atomic_exchange_explicit(&ring->wake, false, memory_order_acquire)) {
+			ready = false;
+			break;
+		}
+		if (xTaskCheckForTimeOut(&xTimeOut, &xTicksToWait) == pdTRUE) {
+			ready = false;
+			break;
+		}
+		if (xSemaphoreTake(ring->dataReady, xTicksToWait) != pdTRUE) {
+			ready = false;
+			break;
+		}
+	}
+	atomic_store_explicit(&ring->consumerWaiting, false, memory_order_relaxed);
+	return ready;
+}
+
+// Only the consumer moves tail, so the producer asks for old data to be
+// dropped. Data committed after this call is kept.
+void ringDiscard(AUDIO_RING_t * ring) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	atomic_store_explicit(&ring->discardHead, head, memory_order_relaxed);
+	atomic_store_explicit(&ring->discard, true, memory_order_release);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&ring->consumerWaiting, memory_order_relaxed)) {
+		atomic_store_explicit(&ring->consumerWaiting, false, memory_order_relaxed);
+		xSemaphoreGive(ring->dataReady);
+	}
+}
+
+// A ringDiscard() during this call is applied now or by the next call.
+// The consumer may already have read past discardHead, e.g. when the
+// discard came between its ringCheckDiscard() and ringReadSpan().
+bool ringCheckDiscard(AUDIO_RING_t * ring) {
+	if (!atomic_exchange_explicit(&ring->discard, false, memory_order_acquire)) return false;
+	size_t discardHead = atomic_load_explicit(&ring->discardHead, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t length = discardHead - tail;
+	if (length > ringFill(ring)) length = 0;
+	ringRelease(ring, length);
+	return true;
+}
+
+// The consumer has other work than the ring, e.g. queued SCI commands
+void ringWake(AUDIO_RING_t * ring) {
+	atomic_store_explicit(&ring->wake, true, memory_order_release);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&ring->consumerWaiting, memory_order_relaxed)) {
+		atomic_store_explicit(&ring->consumerWaiting, false, memory_order_relaxed);
+		xSemaphoreGive(ring->dataReady);
+	}
+}
+
+// The producer has other work than the ring, e.g. a station switch
+void ringWakeProducer(AUDIO_RING_t * ring) {
+	atomic_store_explicit(&ring->producerWake, true, memory_order_release);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&ring->producerWaiting, memory_order_relaxed)) {
+		atomic_store_explicit(&ring->producerWaiting, false, memory_order_relaxed);
+		xSemaphoreGive(ring->spaceReady);
+	}
+}
@@ -0,0 +1,63 @@
+/* Single producer / single consumer audio ring buffer
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef MAIN_AUDIO_RING_H_
+#define MAIN_AUDIO_RING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+// The producer (network task) writes into the ring in place and the consumer
+// (VS1053 task) reads from it in place. head is only written by the producer
+// and tail only by the consumer, so no lock is needed.
+typedef struct {
+	uint8_t *buffer;
+	size_t size;                            // Byte length of buffer
+	atomic_size_t head;                     // Total bytes written (producer)
+	atomic_size_t tail;                     // Total bytes read (consumer)
+	size_t headOffset;                      // Write position in buffer (producer)
+	size_t tailOffset;                      // Read position in buffer (consumer)
+	size_t highWater;                       // Producer sleeps above this fill
+	size_t lowWater;                        // Producer wakes below this fill
+	atomic_bool producerWaiting;
+	atomic_bool consumerWaiting;
+	atomic_bool discard;                    // The producer asked to drop old data
+	atomic_size_t discardHead;              // head when the discard was asked
+	atomic_bool wake;                       // ringWake() was called
+	atomic_bool producerWake;               // ringWakeProducer() was called
+	SemaphoreHandle_t spaceReady;
+	SemaphoreHandle_t dataReady;
+	uint32_t producerWaits;                 // Number of high watermark waits
+	uint32_t byteRate;                      // Stream bytes per second
+	uint32_t refillMs;                      // Audio played between high and low watermark
+} AUDIO_RING_t;
+
+bool ringInit(AUDIO_RING_t * ring, size_t size, uint32_t caps);
+void ringSetRefill(AUDIO_RING_t * ring, uint32_t refillMs);
+void ringSetBitrate(AUDIO_RING_t * ring, uint32_t kbps);    // Watermarks in ms follow the bitrate
+size_t ringBytes(AUDIO_RING_t * ring, uint32_t ms);         // Stream bytes for ms of audio
+uint32_t ringFillMs(AUDIO_RING_t * ring);                   // ms of audio in the ring
+void ringMeasureCopy(AUDIO_RING_t * ring);                  // Log the feeder copy cost from the ring memory
+size_t ringFill(AUDIO_RING_t * ring);                       // Bytes in the ring
+size_t ringWriteSpan(AUDIO_RING_t * ring, uint8_t **span);  // Contiguous free space at head
+void ringCommit(AUDIO_RING_t * ring, size_t length);        // Publish bytes written to the span
+bool ringWaitSpace(AUDIO_RING_t * ring);                    // Above the high watermark, wait for the low watermark
+size_t ringReadSpan(AUDIO_RING_t * ring, uint8_t **span);   // Contiguous data at tail
+void ringRelease(AUDIO_RING_t * ring, size_t length);       // Give back bytes read from the span
+bool ringWaitData(AUDIO_RING_t * ring, size_t length, TickType_t xTicksToWait); // Wait until length bytes are in the ring
+void ringDiscard(AUDIO_RING_t * ring);                      // Producer: drop everything written so far
+bool ringCheckDiscard(AUDIO_RING_t * ring);                 // Consumer: apply a ringDiscard(), true if done
+void ringWake(AUDIO_RING_t * ring);                         // Any task: make ringWaitData() return false
+void ringWakeProducer(AUDIO_RING_t * ring);                 // Any task: make ringWaitSpace() return false
+
+#endif /* MAIN_AUDIO_RING_H_ */
@@ -0,0 +1,148 @@
+/* HTTP stream body: chunked transfer and ICY metadata
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+
+#include "http_stream.h"
+
+static const char *TAG = "HTTP";
+
+static int hexValue(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// Remove the Transfer-Encoding: chunked framing from recvBuffer in place.
+// The state is kept in hoge, so the framing may be split anywhere across blocks.
+// Chunk extensions and trailers are skipped.
+// Returns the number of payload bytes left at the start of recvBuffer,
+// or -1 when the last chunk has been received.
+int decodeChunked(METADATA_t * hoge, size_t length) {
+	char *in = hoge->recvBuffer;
+	char *end = &hoge->recvBuffer[length];
+	char *out = hoge->recvBuffer;
+
+	while (in < end) {
+		switch (hoge->chunkState) {
+		case CHUNK_SIZE:
+		case CHUNK_EXTENSION:
+			if (*in == 0x0A) {
+				if (hoge->chunkCount == 0) {
+					hoge->chunkState = CHUNK_TRAILER; // Last chunk, count trailer line length from here
+				} else {
+					ESP_LOGD(TAG, "chunkSize=%d", hoge->chunkCount);
+					hoge->chunkState = CHUNK_DATA;
+				}
+			} else if (hoge->chunkState == CHUNK_SIZE && hexValue(*in) >= 0) {
+				hoge->chunkCount = (hoge->chunkCount << 4) + hexValue(*in);
+			} else if (*in != 0x0D) {
+				hoge->chunkState = CHUNK_EXTENSION;
+			}
+			in++;
+			break;
+		case CHUNK_DATA: {
+			size_t copy = end - in;
+			if (copy > hoge->chunkCount) copy = hoge->chunkCount;
+			memmove(out, in, copy);
+			out += copy;
+			in += copy;
+			hoge->chunkCount -= copy;
+			if (hoge->chunkCount == 0) hoge->chunkState = CHUNK_DATA_END;
+			break;
+		}
+		case CHUNK_DATA_END:
+			if (*in == 0x0A) hoge->chunkState = CHUNK_SIZE;
+			in++;
+			break;
+		case CHUNK_TRAILER:
+			if (*in == 0x0A) {
+				if (hoge->chunkCount == 0) hoge->chunkState = CHUNK_DONE; // Empty line
+				hoge->chunkCount = 0;
+			} else if (*in != 0x0D) {
+				hoge->chunkCount++;
+			}
+			in++;
+			break;
+		case CHUNK_DONE:
+			in = end;
+			break;
+		}
+	}
+	if (out == hoge->recvBuffer && hoge->chunkState == CHUNK_DONE) return -1;
+	return out - hoge->recvBuffer;
+}
+
+// Split recvBuffer into stream data and metadata.
+// metaintSize is counted across block boundaries, and a metadata block may
+// span several receive blocks.
+// Returns METADATA, STREAMDATA (streamdata is full, or recvBuffer is used up),
+// MALLOCFAIL, or NEEDDATA when recvBuffer is used up and there is no stream data.
+int icyDemux(METADATA_t * hoge) {
+	while(1) {
+		if (hoge->recvIndex == hoge->recvLength) {
+			// Hand over the stream data we have before the caller blocks in recv()
+			if (hoge->streamdataSize) return STREAMDATA;
+			return NEEDDATA;
+		}
+		char *block = &hoge->recvBuffer[hoge->recvIndex];
+		size_t blockSize = hoge->recvLength - hoge->recvIndex;
+
+		if (hoge->metadataCount) {
+			size_t length = hoge->metadataCount;
+			if (length > blockSize) length = blockSize;
+			memcpy(&hoge->metadata[hoge->metadataSize - hoge->metadataCount], block, length);
+			hoge->recvIndex += length;
+			hoge->metadataCount -= length;
+			if (hoge->metadataCount) continue;
+			hoge->metadata[hoge->metadataSize] = 0;
+			return METADATA;
+		}
+
+		if (hoge->metaintSize != 0 && hoge->currentSize == hoge->metaintSize) {
+			hoge->currentSize = 0;
+			hoge->metadataSize = (uint8_t)block[0] * 16;
+			hoge->recvIndex++;
+			ESP_LOGD(TAG, "buffer=%x metadataSize=%d",block[0], hoge->metadataSize);
+			if (hoge->metadataSize == 0) continue;
+
+			if (hoge->metadata == NULL) {
+				hoge->metadata = malloc(hoge->metadataSize+1);
+				if (hoge->metadata == NULL) {
+					ESP_LOGE(TAG, "malloc fail");
+					return MALLOCFAIL;
+				}
+			} else {
+				char *tmp = realloc( hoge->metadata, hoge->metadataSize+1);
+				if (tmp == NULL) {
+					ESP_LOGE(TAG, "realloc fail");
+					return MALLOCFAIL;
+				}
+				hoge->metadata = tmp;
+			}
+			hoge->metadataCount = hoge->metadataSize;
+			continue;
+		}
+
+		// Stream data up to the next metadata block
+		size_t length = hoge->bufferSize - hoge->streamdataSize;
+		if (length > blockSize) length = blockSize;
+		if (hoge->metaintSize != 0 && length > hoge->metaintSize - hoge->currentSize) {
+			length = hoge->metaintSize - hoge->currentSize;
+		}
+		memcpy(&hoge->streamdata[hoge->streamdataSize], block, length);
+		hoge->recvIndex += length;
+		hoge->streamdataSize += length;
+		hoge->currentSize += length;
+		if (hoge->streamdataSize == hoge->bufferSize) return STREAMDATA;
+	} // end while
+}
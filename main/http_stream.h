@@ -0,0 +1,58 @@
+/* HTTP stream body: chunked transfer and ICY metadata
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef MAIN_HTTP_STREAM_H_
+#define MAIN_HTTP_STREAM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// The socket is read by main.c. The functions here only work on recvBuffer,
+// so they don't block.
+typedef struct {
+	size_t	currentSize;				// Total number of stream data
+	size_t	metaintSize;				// icy-Metaint bytes
+	size_t	bufferSize;					// Byte length of buffer
+	size_t	metadataSize;				// Byte length of metadata
+	size_t	metadataCount;				// Bytes of metadata not yet received
+	char	*metadata;					// Buffer of metadata
+	size_t	streamdataSize;				// Byte length of stream data
+	char	*streamdata;				// Buffer of streamdata
+	char	*StreamTitle;
+	char	*StreamUrl;
+	bool	chunked;					// Transfer-Encording: chunked
+	int		chunkState;					// Position in the chunked framing
+	size_t	chunkCount;					// Byte size of chunk / bytes left in chunk
+	char	*recvBuffer;				// Block received from socket
+	size_t	recvSize;					// Byte length of recvBuffer
+	size_t	recvLength;					// Bytes in recvBuffer
+	size_t	recvIndex;					// Bytes of recvBuffer already consumed
+	uint32_t recvCalls;					// Number of recv() calls
+	uint32_t recvBytes;					// Bytes received
+} METADATA_t;
+
+#define	METADATA	100
+#define	STREAMDATA	200
+#define	NEEDDATA	400					// recvBuffer is used up
+#define	RECVTIMEOUT	800
+#define	READFAIL	900
+#define	MALLOCFAIL	910
+
+#define	CHUNK_SIZE		0				// chunk-size hex digits
+#define	CHUNK_EXTENSION	1				// ;chunk-ext up to CRLF
+#define	CHUNK_DATA		2				// chunk-data
+#define	CHUNK_DATA_END	3				// CRLF after chunk-data
+#define	CHUNK_TRAILER	4				// trailer lines after the last chunk
+#define	CHUNK_DONE		5				// end of body
+
+int decodeChunked(METADATA_t * hoge, size_t length);        // Remove the chunked framing in place
+int icyDemux(METADATA_t * hoge);                            // Split recvBuffer into stream data and metadata
+
+#endif /* MAIN_HTTP_STREAM_H_ */
@@ -10,15 +10,17 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <string.h>
+#include <stddef.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
 #include "freertos/ringbuf.h"
-#include "freertos/message_buffer.h"
 #include "esp_system.h"
+#include "esp_heap_caps.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 
 #include "driver/rmt.h"
@@ -31,6 +33,11 @@
 #include "lwip/dns.h"
 
 #include "vs1053.h"
+#include "audio_ring.h"
+#include "audio_frame.h"
+#include "http_stream.h"
+#include "station.h"
+#include "trace.h"
 
 /* FreeRTOS event group to signal when we are connected*/
 static EventGroupHandle_t s_wifi_event_group;
@@ -42,8 +49,9 @@ static EventGroupHandle_t s_wifi_event_group;
 #define WIFI_FAIL_BIT		BIT1
 
 #define HTTP_RESUME_BIT		BIT0
-#define HTTP_CLOSE_BIT		BIT2
 #define PLAY_START_BIT		BIT4
+#define STATION_NEXT_BIT	BIT6
+#define STATION_PREV_BIT	BIT7
 
 static const char *TAG = "MAIN";
 
@@ -51,13 +59,57 @@ static int s_retry_num = 0;
 
 RingbufHandle_t xRingbufferConsole;
 RingbufHandle_t xRingbufferBroadcast;
-MessageBufferHandle_t xMessageBuffer;
+AUDIO_RING_t audioRing;
 
 #define xRingbufferConsoleSize 1024
 #define xRingbufferBroadcastSize 1024
-#define xMessageBufferSize 102400L
+// The client stops reading the socket when the ring fills above the high
+// watermark, and the player wakes it up when it drains below the low watermark.
+// In between, TCP flow control holds back the server.
+#define xAudioRingSize (CONFIG_AUDIO_BUFFER_SIZE * 1024L)
+#if CONFIG_AUDIO_BUFFER_PSRAM
+#define xAudioRingCaps MALLOC_CAP_SPIRAM
+#else
+#define xAudioRingCaps MALLOC_CAP_8BIT
+#endif
 
 EventGroupHandle_t xEventGroup;
+VS1053_t *player = NULL;	// Set once the VS1053 is up
+
+// Task layout
+// The WiFi stack runs on PRO_CPU. The feeder and its DREQ interrupt get a core of their own.
+#if CONFIG_TASK_PINNED
+#define FEEDER_CORE		CONFIG_FEEDER_CORE
+#define NETWORK_CORE	CONFIG_NETWORK_CORE
+#else
+#define FEEDER_CORE		tskNO_AFFINITY
+#define NETWORK_CORE	tskNO_AFFINITY
+#endif
+
+// Stack sizes in bytes. With CONFIG_SDI_STATS the unused stack of each task is logged.
+#define VS1053_STACK	(1024*8)
+#define CLIENT_STACK	(1024*10)
+#define METADATA_STACK	(1024*4)
+#define IR_STACK		(1024*2)
+#define PRECONNECT_STACK	(1024*4)
+#define TRACE_STACK		(1024*3)
+
+#define MAX_TASK 10
+static TaskHandle_t taskList[MAX_TASK];
+static int taskCount = 0;
+
+static void taskCreate(TaskFunction_t function, const char * name, uint32_t stack, UBaseType_t priority, BaseType_t core) {
+	TaskHandle_t task = NULL;
+	xTaskCreatePinnedToCore(function, name, stack, NULL, priority, &task, core);
+	configASSERT( task );
+	if (taskCount < MAX_TASK) taskList[taskCount++] = task;
+}
+
+static void printStackStats(void) {
+	for (int i=0; i<taskCount; i++) {
+		ESP_LOGI(TAG, "%s stack %u bytes unused", pcTaskGetName(taskList[i]), uxTaskGetStackHighWaterMark(taskList[i]));
+	}
+}
 
 static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
@@ -259,6 +311,29 @@ static void ir_rx_task(void *arg)
 						ESP_LOGI(pcTaskGetName(0), "play stop");
 						xEventGroupClearBits( xEventGroup, PLAY_START_BIT );
 					}
+					if (addr == CONFIG_IR_ADDR_NEXT && cmd == CONFIG_IR_CMD_NEXT && !repeat) {
+						ESP_LOGI(pcTaskGetName(0), "next station");
+						xEventGroupSetBits( xEventGroup, STATION_NEXT_BIT );
+						ringWakeProducer(&audioRing);
+					}
+					if (addr == CONFIG_IR_ADDR_PREV && cmd == CONFIG_IR_CMD_PREV && !repeat) {
+						ESP_LOGI(pcTaskGetName(0), "previous station");
+						xEventGroupSetBits( xEventGroup, STATION_PREV_BIT );
+						ringWakeProducer(&audioRing);
+					}
+					// Held buttons repeat. The player merges the steps it hasn't written yet.
+					if (addr == CONFIG_IR_ADDR_VOLUP && cmd == CONFIG_IR_CMD_VOLUP && player) {
+						uint8_t vol = getVolume(player);
+						vol = (vol > 95) ? 100 : vol + 5;
+						ESP_LOGI(pcTaskGetName(0), "volume %d", vol);
+						setVolume(player, vol);
+					}
+					if (addr == CONFIG_IR_ADDR_VOLDOWN && cmd == CONFIG_IR_CMD_VOLDOWN && player) {
+						uint8_t vol = getVolume(player);
+						vol = (vol < 5) ? 0 : vol - 5;
+						ESP_LOGI(pcTaskGetName(0), "volume %d", vol);
+						setVolume(player, vol);
+					}
 				}
 			}
 			//after parsing the data, return spaces to ringbuffer.
@@ -277,281 +352,392 @@ static void ir_rx_task(void *arg)
 #endif
 
 #if 0
+#define CONFIG_SPI_HOST_HSPI 1
+#define CONFIG_GPIO_SCLK 18
+#define CONFIG_GPIO_MISO 19
+#define CONFIG_GPIO_MOSI 23
 #define CONFIG_GPIO_CS 5
 #define CONFIG_GPIO_DCS 16
 #define CONFIG_GPIO_DREQ 4
 #define CONFIG_GPIO_RESET -1
 #endif
 
+#if CONFIG_SPI_HOST_VSPI
+#define VS1053_HOST VSPI_HOST
+#else
+#define VS1053_HOST HSPI_HOST
+#endif
+
+// Playback policy
+// Playing starts when the ring holds targetMs of audio. Every underrun
+// raises the target, until no underrun has been seen for a while.
+typedef struct {
+	uint32_t targetMs;					// Prebuffer target
+	bool	buffering;					// Waiting for the prebuffer target
+	uint32_t underruns;					// Number of underruns
+	int64_t	rebufferUs;					// Total time spent rebuffering after underruns
+	int64_t	bufferingStart;				// Start of the current (re)buffering
+	int64_t	lastUnderrun;				// Time of the last underrun
+	volatile int64_t switchStart;		// Time of the last station switch
+	size_t	trackStart;					// Ring position of the first frame of a new stream
+	uint8_t	trackFormat;				// VS1053_FORMAT_xxx of that stream
+	atomic_bool trackMarked;			// The client has set trackStart
+} PLAYBACK_t;
+
+PLAYBACK_t playback;
+
+#define PLAYBACK_STABLE_US (300 * 1000000LL)	// Return to CONFIG_PREBUFFER_MS after 5 minutes without underrun
+
+static void playbackInit(PLAYBACK_t * play) {
+	play->targetMs = CONFIG_PREBUFFER_MS;
+	play->buffering = true;
+	play->underruns = 0;
+	play->rebufferUs = 0;
+	play->bufferingStart = esp_timer_get_time();
+	play->lastUnderrun = 0;
+	play->switchStart = 0;
+}
+
+// Client: a new stream starts at ring position start.
+// trackMarked starts out false with the global, so the client may mark before playbackInit().
+static void playbackMarkTrack(PLAYBACK_t * play, size_t start, uint8_t format) {
+	play->trackStart = start;
+	play->trackFormat = format;
+	atomic_store_explicit(&play->trackMarked, true, memory_order_release);
+}
+
+// Player: clip length to the start of a marked stream, and tell the VS1053 when it gets there.
+static size_t playbackTrack(PLAYBACK_t * play, VS1053_t * dev, size_t length) {
+	if (!atomic_load_explicit(&play->trackMarked, memory_order_acquire)) return length;
+	size_t ahead = play->trackStart - atomic_load_explicit(&audioRing.tail, memory_order_relaxed);
+	if (ahead == 0 || ahead > ringFill(&audioRing)) {
+		// Reached, or dropped by a station switch.
+		// A running stop ends the old stream first, playChunk() completes it.
+		if (!startTrack(dev, play->trackFormat)) return 0;
+		atomic_store_explicit(&play->trackMarked, false, memory_order_relaxed);
+	} else if (ahead < length) {
+		length = ahead;
+	}
+	return length;
+}
+
+// Advance a stopping song while DREQ is high, like stopSong() does, but
+// without waiting for DREQ. A tick per burst would make the stop take seconds.
+static void playbackStopSteps(VS1053_t * dev) {
+	while (stopSongStep(dev) && current_data_request(dev)) {
+	}
+}
+
+// Bytes to buffer before playing. The client stops at the high watermark.
+static size_t playbackTarget(PLAYBACK_t * play) {
+	size_t target = ringBytes(&audioRing, play->targetMs);
+	if (target > audioRing.highWater) target = audioRing.highWater;
+	if (target == 0) target = 1;
+	return target;
+}
+
+static void playbackStarted(PLAYBACK_t * play) {
+	int64_t elapsed = esp_timer_get_time() - play->bufferingStart;
+	if (play->underruns) play->rebufferUs += elapsed;
+	play->buffering = false;
+	ESP_LOGI(pcTaskGetName(0), "Playing after %lld ms buffering, %"PRIu32" ms buffered",
+		elapsed / 1000, ringFillMs(&audioRing));
+	if (play->switchStart) {
+		ESP_LOGI(pcTaskGetName(0), "Station switch to first audio %lld ms", (esp_timer_get_time() - play->switchStart) / 1000);
+		play->switchStart = 0;
+	}
+}
+
+static void playbackUnderrun(PLAYBACK_t * play) {
+	int64_t now = esp_timer_get_time();
+	if (play->underruns && now - play->lastUnderrun > PLAYBACK_STABLE_US) {
+		play->targetMs = CONFIG_PREBUFFER_MS;
+	} else {
+		// The first underrun too, the prebuffer wasn't enough
+		play->targetMs += play->targetMs / 2;
+		if (play->targetMs > CONFIG_PREBUFFER_MAX_MS) play->targetMs = CONFIG_PREBUFFER_MAX_MS;
+	}
+	play->underruns++;
+	play->lastUnderrun = now;
+	play->buffering = true;
+	play->bufferingStart = now;
+	ESP_LOGW(pcTaskGetName(0), "Underrun %"PRIu32", rebuffering %"PRIu32" ms", play->underruns, play->targetMs);
+}
+
+// Queued SCI commands wake the player
+static void vs1053_wake(void *arg) {
+	ringWake((AUDIO_RING_t *)arg);
+}
+
 static void vs1053_task(void *pvParameters)
 {
 	ESP_LOGI(pcTaskGetName(0), "Start");
 	VS1053_t dev;
-	spi_master_init(&dev,CONFIG_GPIO_CS, CONFIG_GPIO_DCS, CONFIG_GPIO_DREQ, CONFIG_GPIO_RESET);
+	spi_master_init(&dev, VS1053_HOST, CONFIG_GPIO_SCLK, CONFIG_GPIO_MISO, CONFIG_GPIO_MOSI,
+		CONFIG_GPIO_CS, CONFIG_GPIO_DCS, CONFIG_GPIO_DREQ, CONFIG_GPIO_RESET);
+	player = &dev;
 	ESP_LOGI(pcTaskGetName(0), "spi_master_init done");
 	switchToMp3Mode(&dev);
 	//setVolume(&dev, 100);
 	ESP_LOGI(pcTaskGetName(0), "CONFIG_VOLUME=%d", CONFIG_VOLUME);
 	setVolume(&dev, CONFIG_VOLUME);
-
-	char *buffer = malloc(MAX_HTTP_RECV_BUFFER);
-	if (buffer == NULL) {
-		ESP_LOGE(pcTaskGetName(0), "Cannot malloc http receive buffer");
-		while(1) { vTaskDelay(1); }
-	}
+	// This task owns the bus. Other tasks queue their SCI commands,
+	// which are slotted in between the SDI bursts.
+	sciSetOwner(&dev, vs1053_wake, &audioRing);
 
 	// start http client
 	xEventGroupSetBits( xEventGroup, HTTP_RESUME_BIT );
 	ESP_LOGI(pcTaskGetName(0), "xEventGroupSetBits");
 
-	size_t item_size;
+#if CONFIG_SDI_STATS
+	TickType_t statsTick = xTaskGetTickCount();
+#endif
+#if CONFIG_HEALTH_MONITOR
+	TickType_t healthTick = xTaskGetTickCount();
+#endif
+#if CONFIG_HEALTH_TEST
+	TickType_t stallTick = xTaskGetTickCount();
+	bool stalled = false;
+#endif
+	playbackInit(&playback);
 	while (1) {
-		item_size = xMessageBufferReceive(xMessageBuffer, buffer, MAX_HTTP_RECV_BUFFER, portMAX_DELAY);
+		sciService(&dev, VS1053_SCI_QUEUE_SIZE);
+
+		// While a song is stopping, wake up to advance it
+		TickType_t xTicksToWait = portMAX_DELAY;
+		if (dev.cancelState != VS1053_CANCEL_IDLE) xTicksToWait = 1;
+
+		if (ringCheckDiscard(&audioRing)) {
+			// New station. End the old stream and buffer the new one.
+			TRACE(TRACE_DISCARD, atomic_load(&audioRing.tail));
+			stopSongAsync(&dev, NULL, NULL);
+			playback.buffering = true;
+			playback.bufferingStart = esp_timer_get_time();
+			continue;
+		}
+
+		if (playback.buffering) {
+			if (!ringWaitData(&audioRing, playbackTarget(&playback), xTicksToWait)) {
+				playbackStopSteps(&dev);
+				continue;
+			}
+			if (ringFill(&audioRing) < playbackTarget(&playback)) continue; // Woken by ringDiscard()
+			playbackStarted(&playback);
+		}
+
+		// Play straight from the ring
+		uint8_t *span;
+		size_t length = ringReadSpan(&audioRing, &span);
+		if (length == 0) {
+			// An empty ring while stopped by the remote isn't an underrun
+			if (xEventGroupGetBits(xEventGroup) & PLAY_START_BIT) {
+				playbackUnderrun(&playback);
+				continue;
+			}
+			if (!ringWaitData(&audioRing, 1, xTicksToWait)) playbackStopSteps(&dev);
+			continue;
+		}
 #if 0
-		size_t space = xMessageBufferSpacesAvailable(xMessageBuffer);
-		ESP_LOGI(pcTaskGetTaskName(NULL), "space=%d", space);
+		size_t fill = ringFill(&audioRing);
+		ESP_LOGI(pcTaskGetTaskName(NULL), "fill=%d", fill);
+#endif
+		if (length > MAX_HTTP_RECV_BUFFER) length = MAX_HTTP_RECV_BUFFER;
+		length = playbackTrack(&playback, &dev, length);
+#if CONFIG_HEALTH_TEST
+		// Non-audio bytes in place of the stream. The decoder finds no frame, so
+		// SCI_DECODE_TIME and SCI_HDAT0/1 stop like in a stalled decoder.
+		if (stalled) memset(span, 0x55, length);
+#endif
+		TRACE(TRACE_READ, atomic_load(&audioRing.tail) + length);
+		playChunk(&dev, span, length);
+		TRACE(TRACE_SENT, 0);
+		ringRelease(&audioRing, length);
+		// Once the decoder is on the new stream, getDecodedTime() counts from its start
+		trackChanged(&dev);
+#if CONFIG_HEALTH_MONITOR
+		// SCI_DECODE_TIME counts seconds, so look every 2 seconds
+		if ((xTaskGetTickCount() - healthTick) >= pdMS_TO_TICKS(2000)) {
+			uint8_t action = recoverHealth(&dev, checkHealth(&dev));
+#if CONFIG_HEALTH_TEST
+			// The stall lasts until the monitor acts on it
+			if (stalled && action != VS1053_RECOVER_NONE) stalled = false;
+#else
+			(void)action;
+#endif
+			healthTick = xTaskGetTickCount();
+		}
+#endif
+#if CONFIG_HEALTH_TEST
+		// Stall the decoder once a minute
+		if ((xTaskGetTickCount() - stallTick) >= pdMS_TO_TICKS(60000)) {
+			ESP_LOGW(pcTaskGetName(0), "Simulated decoder stall");
+			stalled = true;
+			stallTick = xTaskGetTickCount();
+		}
+#endif
+#if CONFIG_SDI_STATS
+		if ((xTaskGetTickCount() - statsTick) >= pdMS_TO_TICKS(10000)) {
+			printSdiStats(&dev);
+			printStackStats();
+			ESP_LOGI(pcTaskGetName(0), "buffer %"PRIu32" ms, target %"PRIu32" ms, %"PRIu32" underruns, %lld ms rebuffering",
+				ringFillMs(&audioRing), playback.targetMs, playback.underruns, playback.rebufferUs / 1000);
+			statsTick = xTaskGetTickCount();
+		}
 #endif
-		playChunk(&dev, (uint8_t *)buffer, item_size);
 	}
 
 	// never reach here
-	free(buffer);
 	ESP_LOGI(pcTaskGetName(0), "Finish");
 	vTaskDelete(NULL);
 }
 
-typedef struct {
-	size_t headerSize;
-	char   *headerBuffer;
-} HEADER_t;
-
-
-uint16_t saveHeader(HEADER_t * header, char * buf, int length) {
-	if (header->headerBuffer == NULL) {
-		header->headerBuffer = malloc(length+1);
-		if (header->headerBuffer== NULL) {
-			ESP_LOGE(TAG, "headerBuffer malloc fail");
-			return 0;
-		}
-		memcpy(header->headerBuffer, buf, length);
-		header->headerSize = length;
-		header->headerBuffer[header->headerSize] = 0;
-	} else {
-		char * tmp;
-		tmp = realloc(header->headerBuffer, header->headerSize+length+1);
-		if (tmp == NULL) {
-			ESP_LOGE(TAG, "headerBuffer realloc fail");
-			return 0;
-		}
-		header->headerBuffer = tmp;
-		memcpy(&header->headerBuffer[header->headerSize], buf, length);
-		header->headerSize = header->headerSize + length;
-		header->headerBuffer[header->headerSize] = 0;
-	}
-	return header->headerSize;
-}
-
-uint16_t getIcyMetaint(HEADER_t * header) {
-	char *sp1 = strstr(header->headerBuffer, "\r\nicy-metaint");
-	//printf("sp1=%p\n",sp1);
-	if (sp1 == NULL) return 0;
-
-	char *sp2 = strstr(sp1+2, "\r\n");
-	//printf("sp2=%p\n",sp2);
-
-	size_t icyMetaintSize = sp2-sp1-2;
-	ESP_LOGI(TAG, "icyMetaintSize=%d",icyMetaintSize);
-	char * icyMetaintBuffer = malloc(icyMetaintSize+1);
-	if (icyMetaintBuffer == NULL) {
-		ESP_LOGE(TAG, "icyMetaintBuffer malloc fail");
-		return 0;
-	}
-	strncpy(icyMetaintBuffer, sp1+2, icyMetaintSize);
-	icyMetaintBuffer[icyMetaintSize] = 0;
-	ESP_LOGI(TAG, "icyMetaintBuffer=[%s]",icyMetaintBuffer);
-
-	uint16_t rval = 0;
-	char * sp3 = strstr(icyMetaintBuffer, ":");
-	if (sp3 != NULL) {
-		rval = strtol(sp3+1, NULL, 10);
-		ESP_LOGI(TAG, "rval=%d",rval);
-	}
-	free(icyMetaintBuffer);
-	return rval;
-} 
-
-bool isTransferChunked(HEADER_t * header) {
-	char *sp1;
-	sp1 = strstr(header->headerBuffer, "\r\nTransfer-Encoding:");
-	if (sp1 == NULL) {
-		sp1 = strstr(header->headerBuffer, "\r\ntransfer-encoding:");
-	}
-	ESP_LOGD(TAG, "isTransferChunked sp1=%p", sp1);
-	if (sp1 != NULL) {
-		char *sp2 = strstr(sp1+20, "chunked");
-		ESP_LOGD(TAG, "isTransferChunked sp2=%p", sp2);
-		if (sp2 != NULL) return true;
-	}
-	return false;
-}
+#define MAX_HTTP_BLOCK_SIZE 4096
 
+#define RECV_POLL_MS	500				// recv() timeout while streaming
+#define RECV_STALL_MS	10000			// Give up on a server that sends nothing this long
 
-uint16_t readHeader(int fd, HEADER_t * header) {
-	header->headerSize = 0;
-	header->headerBuffer = NULL;
-	int index = 0;
-	char buffer[128];
-	int flag = 0;
-
+// Receive the next block of the stream into recvBuffer.
+// With chunked transfer the framing is removed, so recvBuffer only holds payload.
+int readStreamBlock(int fd, METADATA_t * hoge) {
 	while(1) {
-		// read data
-		int read_len = read(fd, &buffer[index], 1);
-		if (read_len == 0) continue;
-		if (read_len < 0) {
+		int read_len = recv(fd, hoge->recvBuffer, hoge->recvSize, 0);
+		if (read_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return RECVTIMEOUT;
+		if (read_len <= 0) {
+			// I don't know why it is disconnected from the server.
 			ESP_LOGW(pcTaskGetName(0), "read_len = %d", read_len);
 			ESP_LOGW(pcTaskGetName(0), "errno = %d", errno);
-			break;
-		}
-		
-		if (buffer[index] == 0x0D) {
-			flag++;
-		} else if (buffer[index] == 0x0A) {
-			flag++;
-		} else {
-			flag = 0;
-		}
-
-		index++;
-		if (flag == 4) {
-			saveHeader(header, buffer, index);
-			break;
+			return READFAIL;
 		}
-		if (index == 128) {
-			saveHeader(header, buffer, index);
-			index = 0;
+		TRACE(TRACE_RECV, 0);
+		hoge->recvCalls++;
+		hoge->recvBytes += read_len;
+		if (hoge->chunked) {
+			read_len = decodeChunked(hoge, read_len);
+			if (read_len < 0) {
+				ESP_LOGW(pcTaskGetName(0), "Last chunk received");
+				return READFAIL;
+			}
+			if (read_len == 0) continue; // Only framing in this block
 		}
+		hoge->recvLength = read_len;
+		hoge->recvIndex = 0;
+		return 0;
 	}
-	return header->headerSize;
 }
 
-
-typedef struct {
-	size_t	currentSize;				// Total number of stream data
-	size_t	metaintSize;				// icy-Metaint bytes
-	size_t	bufferSize;					// Byte length of buffer
-	size_t	metadataSize;				// Byte length of metadata
-	char	*metadata;					// Buffer of metadata
-	size_t	streamdataSize;				// Byte length of stream data
-	char	*streamdata;				// Buffer of streamdata
-	char	*StreamTitle;
-	char	*StreamUrl;
-	bool	chunked;					// Transfer-Encording: chunked
-	size_t	chunkCount;					// Byte size of chunk
-} METADATA_t;
-
-#define	METADATA	100
-#define	STREAMDATA	200
-#define	READFAIL	900
-#define	MALLOCFAIL	910
-
+// Split the received blocks into stream data and metadata.
 int readStremDataWithMetadata(int fd, METADATA_t * hoge) {
-	char buffer[1];
 	while(1) {
-		int read_len = read(fd, buffer, 1);
-		if (read_len < 0) {
-			// I don't know why it is disconnected from the server.
-			ESP_LOGW(pcTaskGetName(0), "read_len = %d", read_len);
-			ESP_LOGW(pcTaskGetName(0), "errno = %d", errno);
-			return READFAIL;
-		}
+		int type = icyDemux(hoge);
+		if (type != NEEDDATA) return type;
+		int ret = readStreamBlock(fd, hoge);
+		if (ret != 0) return ret;
+	}
+}
 
-		if (hoge->metaintSize == 0) {
-			hoge->streamdata[hoge->streamdataSize] = buffer[0];
-			hoge->streamdataSize++;
-			if (hoge->streamdataSize == hoge->bufferSize) return STREAMDATA;
 
-		} else {
-			if (hoge->currentSize == hoge->metaintSize) {
-				hoge->currentSize = 0;
-				hoge->metadataSize = buffer[0] * 16;
-				ESP_LOGD(TAG, "buffer=%x metadataSize=%d",buffer[0], hoge->metadataSize);
-				if (hoge->metadataSize == 0) continue;
-
-				if (hoge->metadata == NULL) {
-					hoge->metadata = malloc(hoge->metadataSize+1);
-					if (hoge->metadata == NULL) {
-						ESP_LOGE(TAG, "malloc fail");
-						return MALLOCFAIL;
-					}
-				} else {
-					char *tmp = realloc( hoge->metadata, hoge->metadataSize+1);
-					if (tmp == NULL) {
-						ESP_LOGE(TAG, "realloc fail");
-						return MALLOCFAIL;
-					}
-					hoge->metadata = tmp;
-				}
+#define MAX_HTTP_HEADER_SIZE 2048
 
-				for (int i=0; i<hoge->metadataSize; i++) {
-					int read_len = read(fd, buffer, 1);
-					if (read_len < 0) {
-						// I don't know why it is disconnected from the server.
-						ESP_LOGW(pcTaskGetName(0), "read_len = %d", read_len);
-						ESP_LOGW(pcTaskGetName(0), "errno = %d", errno);
-						return READFAIL;
-					}
-					hoge->metadata[i] = buffer[0];
-					hoge->metadata[i+1] = 0;
-				}
-				return METADATA;
+typedef struct {
+	int		status;						// HTTP status code
+	uint16_t icyMetaint;				// icy-metaint
+	uint16_t icyBitrate;				// icy-br [kbit/s]
+	bool	chunked;					// Transfer-Encording: chunked
+	char	*contentType;				// Content-Type (in headerBuffer)
+	char	*location;					// Location (in headerBuffer)
+	size_t	headerSize;					// Bytes used in headerBuffer
+	char	headerBuffer[MAX_HTTP_HEADER_SIZE];	// Header lines
+} HEADER_t;
 
-			} else {
-				hoge->streamdata[hoge->streamdataSize] = buffer[0];
-				hoge->streamdataSize++;
-				hoge->currentSize++;
-				if (hoge->streamdataSize == hoge->bufferSize) return STREAMDATA;
-			}
+// Match a header field name (case-insensitive) and return its value.
+static char *headerValue(char *line, const char *name) {
+	size_t length = strlen(name);
+	if (strncasecmp(line, name, length) != 0) return NULL;
+	if (line[length] != ':') return NULL;
+	line += length + 1;
+	while (*line == ' ' || *line == '\t') line++;
+	return line;
+}
 
-		}
-	} // end while
+static void parseHeaderLine(HEADER_t * header, char * line) {
+	ESP_LOGI(pcTaskGetName(0), "%s", line);
+	char *value;
+	if (header->status == 0) {
+		// Status line. SHOUTcast v1 answers "ICY 200 OK".
+		char *sp = strchr(line, ' ');
+		if (sp != NULL) header->status = strtol(sp+1, NULL, 10);
+		if (header->status == 0) header->status = -1;
+	} else if ((value = headerValue(line, "icy-metaint")) != NULL) {
+		header->icyMetaint = strtol(value, NULL, 10);
+	} else if ((value = headerValue(line, "icy-br")) != NULL) {
+		header->icyBitrate = strtol(value, NULL, 10);
+	} else if ((value = headerValue(line, "Content-Type")) != NULL) {
+		header->contentType = value;
+	} else if ((value = headerValue(line, "Location")) != NULL) {
+		header->location = value;
+	} else if ((value = headerValue(line, "Transfer-Encoding")) != NULL) {
+		// chunked is always the last coding
+		size_t length = strlen(value);
+		header->chunked = (length >= 7 && strcasecmp(&value[length-7], "chunked") == 0);
+	}
 }
 
+// Read and parse the response header in one pass.
+// SHOUTcast server does not return header length.
+// Therefore, it is necessary to find the end of the header.
+// Stream data received after the header is left in recvBuffer.
+// Returns the HTTP status code, or -1 if the connection failed.
+int readHeader(int fd, HEADER_t * header, METADATA_t * hoge) {
+	header->status = 0;
+	header->icyMetaint = 0;
+	header->icyBitrate = 0;
+	header->chunked = false;
+	header->contentType = NULL;
+	header->location = NULL;
+	header->headerSize = 0;
+	size_t lineStart = 0;
+	size_t lineLength = 0;
 
-int readStremDataWithChunked(int fd, METADATA_t * hoge) {
-	char buffer[2];
-	static size_t chunkSize = 0;
 	while(1) {
-		int read_len = read(fd, buffer, 1);
-		if (read_len < 0) {
-			// I don't know why it is disconnected from the server.
-			ESP_LOGW(pcTaskGetName(0), "read_len = %d", read_len);
-			ESP_LOGW(pcTaskGetName(0), "errno = %d", errno);
-			return READFAIL;
-		}
-
-		if (hoge->chunkCount == 0) {
-			if (buffer[0] == 0x0D) {
-
-			} else if (buffer[0] == 0x0A) {
-				ESP_LOGD(TAG, "chunkSize=%d", chunkSize);
-				hoge->chunkCount = chunkSize;
-				chunkSize = 0;
-			} else {
-				ESP_LOGD(TAG, "buffer[0]=%c", buffer[0]);
-				buffer[1] = 0;
-				long byte = strtol(buffer, NULL, 16);
-				chunkSize = (chunkSize << 4) + byte;
+		if (hoge->recvIndex == hoge->recvLength) {
+			int read_len = recv(fd, hoge->recvBuffer, hoge->recvSize, 0);
+			if (read_len <= 0) {
+				ESP_LOGW(pcTaskGetName(0), "read_len = %d", read_len);
+				ESP_LOGW(pcTaskGetName(0), "errno = %d", errno);
+				return -1;
 			}
-		} else {
-			hoge->chunkCount--;
-			hoge->streamdata[hoge->streamdataSize] = buffer[0];
-			hoge->streamdataSize++;
-			if (hoge->streamdataSize == hoge->bufferSize) return STREAMDATA;
+			hoge->recvLength = read_len;
+			hoge->recvIndex = 0;
 		}
-	} // end while
-}
-
+		char c = hoge->recvBuffer[hoge->recvIndex++];
+		if (c == 0x0D) continue;
+		if (c != 0x0A) {
+			// Lines that don't fit are truncated, always keep room for the terminator
+			if (header->headerSize < MAX_HTTP_HEADER_SIZE-1) header->headerBuffer[header->headerSize++] = c;
+			lineLength++;
+			continue;
+		}
+		if (lineLength == 0) break; // Empty line
+		while (header->headerSize > lineStart && header->headerBuffer[header->headerSize-1] == ' ') header->headerSize--;
+		header->headerBuffer[header->headerSize++] = 0;
+		parseHeaderLine(header, &header->headerBuffer[lineStart]);
+		if (header->headerSize == MAX_HTTP_HEADER_SIZE) header->headerSize--; // Share the last terminator
+		lineStart = header->headerSize;
+		lineLength = 0;
+	}
 
+	if (header->status == 0) header->status = -1;
+	hoge->chunked = header->chunked;
+	if (hoge->chunked) {
+		// Remove the framing from the stream data that came with the header
+		size_t length = hoge->recvLength - hoge->recvIndex;
+		memmove(hoge->recvBuffer, &hoge->recvBuffer[hoge->recvIndex], length);
+		int read_len = decodeChunked(hoge, length);
+		hoge->recvIndex = 0;
+		hoge->recvLength = (read_len < 0) ? 0 : read_len;
+	}
+	return header->status;
+}
 
 void HexDump(char * buff, uint8_t len) {
 	int loop = (len + 9) / 10;
@@ -610,116 +796,71 @@ uint16_t getStreamUrl(METADATA_t * hoge) {
 	return len;
 }
 
-#define SERVER_HOST	   CONFIG_SERVER_HOST
-#define SERVER_PORT	   CONFIG_SERVER_PORT
-#define SERVER_PATH	   CONFIG_SERVER_PATH
-
 /*
 .url = "http://ice2.somafm.com:80/seventies-128-mp3",
 
-#define SERVER_HOST "ice2.somafm.com"
-#define SERVER_PORT 80
-#define SERVER_PATH "/seventies-128-mp3"
+CONFIG_SERVER_HOST "ice2.somafm.com"
+CONFIG_SERVER_PORT 80
+CONFIG_SERVER_PATH "/seventies-128-mp3"
 */
 
 #define MAX_HTTP_SEND_BUFFER 512
+#define MAX_HTTP_REDIRECT 5
+
+// Reconnect with exponential backoff. Playing continues from the audio buffer.
+#define RECONNECT_MIN_MS 500
+#define RECONNECT_MAX_MS 30000
+#define RECONNECT_STABLE_US (30 * 1000000LL)	// A connection that lasted this long reconnects at once
+
+#define	STATION_SWITCH	300
+
+uint32_t clientReconnects = 0;
+
+// Switch station, if the remote asked for it.
+// The player drops what is buffered from the current one.
+static bool client_switch(void) {
+	EventBits_t stationBits = xEventGroupGetBits(xEventGroup) & (STATION_NEXT_BIT | STATION_PREV_BIT);
+	if (stationBits == 0) return false;
+	xEventGroupClearBits( xEventGroup, stationBits );
+	stationSelect((stationBits & STATION_NEXT_BIT) ? 1 : -1);
+	ESP_LOGI(pcTaskGetName(0), "Switch to preset %d", stationIndex());
+	playback.switchStart = esp_timer_get_time();
+	ringDiscard(&audioRing);
+	return true;
+}
 
-static void client_task(void *pvParameters)
-{
-	ESP_LOGI(pcTaskGetName(0), "Start");
-	xEventGroupWaitBits( xEventGroup,
-			HTTP_RESUME_BIT,	/* The bits within the event group to wait for. */
-			pdTRUE,				/* HTTP_RESUME_BIT should be cleared before returning. */
-			pdFALSE,			/* Don't wait for both bits, either bit will do. */
-			portMAX_DELAY);		/* Wait forever. */
-	ESP_LOGI(pcTaskGetName(0), "HTTP_RESUME_BIT");
-
-	// set up address to connect to
-	ESP_LOGI(pcTaskGetName(0), "SERVER_HOST=%s", SERVER_HOST);
-	ESP_LOGI(pcTaskGetName(0), "SERVER_PORT=%d", SERVER_PORT);
-	ESP_LOGI(pcTaskGetName(0), "SERVER_PATH=%s", SERVER_PATH);
-	struct sockaddr_in server;
-	memset(&server, 0, sizeof(server));
-	server.sin_family = AF_INET;
-	server.sin_port = htons(SERVER_PORT);
-	server.sin_addr.s_addr = inet_addr(SERVER_HOST);
-	if (server.sin_addr.s_addr == 0xffffffff) {
-		struct hostent *host;
-		host = gethostbyname(SERVER_HOST);
-		if (host == NULL) {
-			ESP_LOGE(TAG, "DNS lookup failed. Check %s:%d", SERVER_HOST, SERVER_PORT);
-			while(1) vTaskDelay(10);
-		} else {
-			ESP_LOGI(TAG, "DNS lookup success");
+// Connect to the current preset and read the response header.
+// Redirects are followed.
+// Returns the socket, or -1 if the connection failed.
+static int client_connect(char * buffer, HEADER_t * header, METADATA_t * meta) {
+	URL_t url = *stationGet(stationIndex());
+	for (int redirect = 0; ; redirect++) {
+		// set up address to connect to
+		ESP_LOGI(pcTaskGetName(0), "SERVER_HOST=%s", url.host);
+		ESP_LOGI(pcTaskGetName(0), "SERVER_PORT=%d", url.port);
+		ESP_LOGI(pcTaskGetName(0), "SERVER_PATH=%s", url.path);
+		// One send() for the whole request
+		int fd = stationConnect(&url, buffer, MAX_HTTP_SEND_BUFFER + 1);
+		if (fd < 0) {
+			ESP_LOGE(TAG, "Can't connect server");
+			return -1;
 		}
-		server.sin_addr.s_addr = *(unsigned int *)host->h_addr_list[0];
-	}
-
-
-	// create the socket
-	int fd;
-	int ret;
-	fd = socket(AF_INET, SOCK_STREAM, 0);
-	LWIP_ASSERT("fd >= 0", fd >= 0);
-
-	// connect to server
-	ret = connect(fd, (struct sockaddr*)&server, sizeof(server));
-	LWIP_ASSERT("ret == 0", ret == 0);
-	ESP_LOGI(pcTaskGetName(0), "Connect server");
-
-	// allocate buffer
-	char *buffer = malloc(MAX_HTTP_SEND_BUFFER + 1);
-	if (buffer == NULL) {
-		ESP_LOGE(pcTaskGetName(0), "Cannot malloc http send buffer");
-		while(1) { vTaskDelay(1); }
-	}
-
-	// send request
-	sprintf(buffer, "GET %s HTTP/1.1\r\n", SERVER_PATH);
-	//sprintf(buffer, "GET %s HTTP/1.0\r\n", SERVER_PATH);
-	ret = send(fd, buffer, strlen(buffer), 0);
-	LWIP_ASSERT("ret == strlen(buffer)", ret == strlen(buffer));
-
-	sprintf(buffer, "HOST: %s\r\n", SERVER_HOST);
-	ret = send(fd, buffer, strlen(buffer), 0);
-	LWIP_ASSERT("ret == strlen(buffer)", ret == strlen(buffer));
-
-	sprintf(buffer, "User-Agent: ESP32/1.00\r\n");
-	ret = send(fd, buffer, strlen(buffer), 0);
-	LWIP_ASSERT("ret == strlen(buffer)", ret == strlen(buffer));
-
-	// receive icy-metadata
-	// https://stackoverflow.com/questions/44050266/get-info-from-streaming-radio
-	sprintf(buffer, "Icy-MetaData: 1\r\n");
-	//sprintf(buffer, "Icy-MetaData: 0\r\n");
-	ret = send(fd, buffer, strlen(buffer), 0);
-	LWIP_ASSERT("ret == strlen(buffer)", ret == strlen(buffer));
-
-	sprintf(buffer, "Connection: close\r\n");
-	ret = send(fd, buffer, strlen(buffer), 0);
-	LWIP_ASSERT("ret == strlen(buffer)", ret == strlen(buffer));
-
-	sprintf(buffer, "\r\n");
-	ret = send(fd, buffer, strlen(buffer), 0);
-	LWIP_ASSERT("ret == strlen(buffer)", ret == strlen(buffer));
-
-	free(buffer);
-
-#if 0
-	// set timeout
-	struct timeval timeout;
-	timeout.tv_usec = 0;
-	timeout.tv_sec = 3;
-	setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
-#endif
-
-	// read HTTP header
-	// SHOUTcast server does not return header length.
-	// Therefore, it is necessary to find the end of the header.
-	HEADER_t header;
-	readHeader(fd, &header);
-	ESP_LOGI(pcTaskGetName(0), "headerBuffer=[%s]",header.headerBuffer);
-	ESP_LOGI(pcTaskGetName(0), "headerSize=%d",header.headerSize);
+		ESP_LOGI(pcTaskGetName(0), "Connect server");
+
+		// set timeout, so a stalled server is noticed
+		struct timeval timeout;
+		timeout.tv_usec = 0;
+		timeout.tv_sec = 10;
+		setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
+
+		// read HTTP header
+		meta->chunked = false;
+		meta->chunkState = CHUNK_SIZE;
+		meta->chunkCount = 0;
+		meta->recvLength = 0;
+		meta->recvIndex = 0;
+		int status = readHeader(fd, header, meta);
+		ESP_LOGI(pcTaskGetName(0), "status=%d headerSize=%d", status, header->headerSize);
 
 #if 0
 HTTP/1.0 200 OK
@@ -742,64 +883,117 @@ Expires: Mon, 26 Jul 1997 05:00:00 GMT
 icy-metaint:16000
 #endif
 
-	if (strncmp(header.headerBuffer, "HTTP/1.0 200 OK", 15) != 0) {
-		if (strncmp(header.headerBuffer, "HTTP/1.1 200 OK", 15) != 0) {
-			ESP_LOGE(TAG, "Can't connect server");
-			while(1) {
-				vTaskDelay(100);
-			}
+		if (status == 200) return fd;
+		close(fd);
+
+		bool moved = (status == 301 || status == 302 || status == 303 || status == 307 || status == 308);
+		if (!moved || header->location == NULL || redirect == MAX_HTTP_REDIRECT) {
+			ESP_LOGE(TAG, "Can't connect server status=%d", status);
+			return -1;
+		}
+		ESP_LOGI(pcTaskGetName(0), "Redirect to %s", header->location);
+		if (!parseUrl(&url, header->location)) {
+			ESP_LOGE(TAG, "Unsupported location %s", header->location);
+			return -1;
 		}
 	}
+}
 
-	uint16_t metaint = getIcyMetaint(&header);
-	ESP_LOGI(pcTaskGetName(0), "metaint=%d", metaint);
-	free(header.headerBuffer);
-
-	METADATA_t meta;
-	meta.currentSize = 0;
-	meta.metaintSize = metaint;
-	meta.bufferSize = MAX_HTTP_RECV_BUFFER;
-	meta.metadataSize = 0;
-	meta.metadata = NULL;
-	meta.streamdataSize = 0;
-	meta.streamdata = malloc(MAX_HTTP_RECV_BUFFER);
-	if (meta.streamdata == NULL) {
-		ESP_LOGE(pcTaskGetName(0), "streamdata malloc fail");
-		while(1) { vTaskDelay(1); }
+// Stream into the audio ring until the connection fails or the station is switched.
+// Returns READFAIL, MALLOCFAIL or STATION_SWITCH.
+static int client_stream(int fd, METADATA_t * meta, uint16_t icyBitrate) {
+	meta->currentSize = 0;
+	meta->metadataCount = 0;
+	meta->streamdataSize = 0;
+	ringSetBitrate(&audioRing, icyBitrate);
+	bool bitrateKnown = (icyBitrate != 0);
+
+	// Follow the frames, so only whole frames reach the VS1053
+	AUDIO_FRAME_t frame;
+	frameReset(&frame);
+
+	TickType_t recvTick = xTaskGetTickCount();
+
+#if CONFIG_STATION_PRECONNECT
+	// Keep the next and the previous preset ready for a fast switch. The preconnect task connects.
+	if (stationCount() > 1) {
+		stationPreconnect(stationGet(stationIndex() + 1), stationGet(stationIndex() + stationCount() - 1));
 	}
-	meta.StreamTitle = NULL;
-	meta.StreamUrl = NULL;
-	meta.chunked = isTransferChunked(&header);
-	ESP_LOGI(pcTaskGetName(0), "chunked=%d", meta.chunked);
-	meta.chunkCount = 0;
+#endif
+
+	// The header was read with the long timeout
+	struct timeval timeout;
+	timeout.tv_usec = (RECV_POLL_MS % 1000) * 1000;
+	timeout.tv_sec = RECV_POLL_MS / 1000;
+	setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
+	int recvTimeouts = 0;
 
 	bool playStatus = true;
 	int playStatusCheck = 0;
 
 	// main loop
 	while(1) {
-		int type;
-		if (meta.chunked) {
-			type = readStremDataWithChunked(fd, &meta);
-		} else {
-			type = readStremDataWithMetadata(fd, &meta);
+		if (client_switch()) return STATION_SWITCH;
+
+		// Stream data is demultiplexed straight into the ring
+		if (meta->streamdataSize == 0) {
+			meta->bufferSize = ringWriteSpan(&audioRing, (uint8_t **)&meta->streamdata);
+			if (meta->bufferSize == 0) {
+				ringWaitSpace(&audioRing); // The remote ends the wait for a switch
+				continue;
+			}
+		}
+		int type = readStremDataWithMetadata(fd, meta);
+		if (type == READFAIL) return type;
+		if (type == MALLOCFAIL) return type;
+		if (type == RECVTIMEOUT) {
+			// Look for a switch between short receive timeouts
+			recvTimeouts++;
+			if (recvTimeouts * RECV_POLL_MS < RECV_STALL_MS) continue;
+			ESP_LOGW(pcTaskGetName(0), "No data for %d ms", RECV_STALL_MS);
+			return READFAIL;
+		}
+		recvTimeouts = 0;
+
+		TickType_t recvElapsed = xTaskGetTickCount() - recvTick;
+		if (recvElapsed >= pdMS_TO_TICKS(10000)) {
+			uint32_t ms = recvElapsed * portTICK_PERIOD_MS;
+			ESP_LOGD(pcTaskGetName(0), "recv %"PRIu32" calls/s %"PRIu32" bytes/s, %"PRIu32" flow control waits",
+				meta->recvCalls * 1000 / ms, (uint32_t)((uint64_t)meta->recvBytes * 1000 / ms), audioRing.producerWaits);
+			ESP_LOGD(pcTaskGetName(0), "%"PRIu32" frames %"PRIu64" ms %"PRIu32" kbit/s, %"PRIu32" junk bytes, %"PRIu32" resyncs",
+				frame.frames, frame.durationUs / 1000, frameAverageBitrate(&frame), frame.junk, frame.resyncs);
+			meta->recvCalls = 0;
+			meta->recvBytes = 0;
+			audioRing.producerWaits = 0;
+			recvTick = xTaskGetTickCount();
 		}
-		if (type == READFAIL) break;
-		if (type == MALLOCFAIL) break;
 
 		if (type == METADATA) {
-			ESP_LOGI(pcTaskGetName(0),"metadataSize=%d metadata=[%s]",meta.metadataSize, meta.metadata); 
+			ESP_LOGI(pcTaskGetName(0),"metadataSize=%d metadata=[%s]",meta->metadataSize, meta->metadata); 
 #if CONFIG_METADATA_CONSOLE || CONFIG_METADATA_BOTH
-			xRingbufferSend(xRingbufferConsole, meta.metadata, meta.metadataSize, 0);
+			xRingbufferSend(xRingbufferConsole, meta->metadata, meta->metadataSize, 0);
 #endif
 #if CONFIG_METADATA_BROADCAST || CONFIG_METADATA_BOTH
-			xRingbufferSend(xRingbufferBroadcast, meta.metadata, meta.metadataSize, 0);
+			xRingbufferSend(xRingbufferBroadcast, meta->metadata, meta->metadataSize, 0);
 #endif
 		}
 
 		if (type == STREAMDATA) {
 			if (playStatus) {
-				xMessageBufferSend(xMessageBuffer, meta.streamdata, meta.streamdataSize, portMAX_DELAY);
+				// Drop the junk in front of the first frame
+				bool started = frame.started;
+				meta->streamdataSize = frameParse(&frame, (uint8_t *)meta->streamdata, meta->streamdataSize, meta->bufferSize);
+				if (!started && frame.started) {
+					// The stream of this connection starts with this block
+					playbackMarkTrack(&playback, atomic_load(&audioRing.head), frame.format);
+				}
+				// Without icy-br, take the bitrate from the frames
+				if (!bitrateKnown && frame.frames >= 100) {
+					ringSetBitrate(&audioRing, frameAverageBitrate(&frame));
+					bitrateKnown = true;
+				}
+				ringCommit(&audioRing, meta->streamdataSize);
+				TRACE(TRACE_COMMIT, atomic_load(&audioRing.head));
 				playStatusCheck++;
 				if (playStatusCheck == 10) {
 					EventBits_t eventBit = xEventGroupGetBits(xEventGroup);
@@ -815,43 +1009,241 @@ icy-metaint:16000
 				if ( (eventBit & PLAY_START_BIT) == 0x10) playStatus = true;
 				playStatusCheck = 0;
 			}
-			meta.streamdataSize = 0;
+			meta->streamdataSize = 0;
 
-#if 0
-			// Adjust the read size according to the free size of xMessageBuffer.
-			size_t freeSize = xMessageBufferSpacesAvailable( xMessageBuffer );
-			meta.bufferSize = MAX_HTTP_RECV_BUFFER;
-			ESP_LOGD(pcTaskGetName(0), "freeSize=%d MAX_HTTP_RECV_BUFFER*2=%d", freeSize, MAX_HTTP_RECV_BUFFER*2);
-			if (freeSize < MAX_HTTP_RECV_BUFFER*2) {
-				meta.bufferSize = freeSize / 2;
-				//meta.bufferSize = 1;
-				ESP_LOGI(pcTaskGetName(0), "freeSize=%d meta.bufferSize=%d", freeSize, meta.bufferSize);
-				vTaskDelay(1);
-			}
-#endif
+			// Above the high watermark, sleep until the player drains the ring to the low watermark
+			ringWaitSpace(&audioRing);
+		}
+	}
+}
 
-			// Wait for more than MAX_HTTP_RECV_BUFFER*2 bytes of free buffer space
-			while (1) {
-				size_t freeSize = xMessageBufferSpacesAvailable( xMessageBuffer );
-				if (freeSize > MAX_HTTP_RECV_BUFFER*2) break;
-				ESP_LOGD(pcTaskGetName(0), "freeSize=%d MAX_HTTP_RECV_BUFFER*2=%d", freeSize, MAX_HTTP_RECV_BUFFER*2);
-				vTaskDelay(1);
-			}
+// The client runs for ever. The buffers are allocated once and kept over reconnects.
+static void client_task(void *pvParameters)
+{
+	ESP_LOGI(pcTaskGetName(0), "Start");
+	xEventGroupWaitBits( xEventGroup,
+			HTTP_RESUME_BIT,	/* The bits within the event group to wait for. */
+			pdTRUE,				/* HTTP_RESUME_BIT should be cleared before returning. */
+			pdFALSE,			/* Don't wait for both bits, either bit will do. */
+			portMAX_DELAY);		/* Wait forever. */
+	ESP_LOGI(pcTaskGetName(0), "HTTP_RESUME_BIT");
+
+	METADATA_t meta;
+	meta.currentSize = 0;
+	meta.bufferSize = 0;
+	meta.metadataSize = 0;
+	meta.metadata = NULL;
+	meta.streamdataSize = 0;
+	meta.streamdata = NULL;
+	meta.StreamTitle = NULL;
+	meta.StreamUrl = NULL;
+	meta.chunked = false;
+	meta.chunkState = CHUNK_SIZE;
+	meta.chunkCount = 0;
+	meta.metadataCount = 0;
+	meta.recvSize = MAX_HTTP_BLOCK_SIZE;
+	meta.recvCalls = 0;
+	meta.recvBytes = 0;
+	meta.recvBuffer = malloc(MAX_HTTP_BLOCK_SIZE);
+	if (meta.recvBuffer == NULL) {
+		ESP_LOGE(pcTaskGetName(0), "recvBuffer malloc fail");
+		while(1) { vTaskDelay(1); }
+	}
+
+	// allocate buffer
+	char *buffer = malloc(MAX_HTTP_SEND_BUFFER + 1);
+	if (buffer == NULL) {
+		ESP_LOGE(pcTaskGetName(0), "Cannot malloc http send buffer");
+		while(1) { vTaskDelay(1); }
+	}
+	HEADER_t *header = malloc(sizeof(HEADER_t));
+	if (header == NULL) {
+		ESP_LOGE(pcTaskGetName(0), "Cannot malloc http header");
+		while(1) { vTaskDelay(1); }
+	}
+
+	uint32_t backoff = 0;
+	int64_t dropTime = 0;
+	while(1) {
+		if (backoff) {
+			ESP_LOGW(pcTaskGetName(0), "Reconnect in %"PRIu32" ms", backoff);
+			// A station switch doesn't wait
+			xEventGroupWaitBits( xEventGroup,
+				STATION_NEXT_BIT | STATION_PREV_BIT,
+				pdFALSE,			/* client_switch() clears the bits. */
+				pdFALSE,			/* Don't wait for both bits, either bit will do. */
+				pdMS_TO_TICKS(backoff));
+		}
+		if (client_switch()) dropTime = 0;
+
+		int fd = client_connect(buffer, header, &meta);
+		if (fd < 0) {
+			backoff = (backoff == 0) ? RECONNECT_MIN_MS : backoff * 2;
+			if (backoff > RECONNECT_MAX_MS) backoff = RECONNECT_MAX_MS;
+			continue;
+		}
+		if (dropTime) {
+			clientReconnects++;
+			ESP_LOGI(pcTaskGetName(0), "Reconnect %"PRIu32" took %lld ms, %"PRIu32" ms buffered",
+				clientReconnects, (esp_timer_get_time() - dropTime) / 1000, ringFillMs(&audioRing));
+			dropTime = 0;
+		}
+
+		meta.metaintSize = header->icyMetaint;
+		ESP_LOGI(pcTaskGetName(0), "metaint=%d", meta.metaintSize);
+		ESP_LOGI(pcTaskGetName(0), "chunked=%d", meta.chunked);
+		if (header->contentType) ESP_LOGI(pcTaskGetName(0), "contentType=%s", header->contentType);
+		if (header->icyBitrate) ESP_LOGI(pcTaskGetName(0), "icyBitrate=%d", header->icyBitrate);
+
+		int64_t connectTime = esp_timer_get_time();
+		int reason = client_stream(fd, &meta, header->icyBitrate);
+		close(fd);
+		if (reason == STATION_SWITCH) {
+			backoff = 0;
+			continue;
+		}
+
+		// Keep playing what is buffered while reconnecting
+		dropTime = esp_timer_get_time();
+		if (dropTime - connectTime > RECONNECT_STABLE_US) {
+			backoff = 0;
+		} else {
+			backoff = (backoff == 0) ? RECONNECT_MIN_MS : backoff * 2;
+			if (backoff > RECONNECT_MAX_MS) backoff = RECONNECT_MAX_MS;
 		}
 	}
 
-	// release memory
-	free(meta.streamdata);
+	// never reach here
+	free(buffer);
+	free(header);
+	free(meta.recvBuffer);
 	if (meta.metadata) free(meta.metadata);
-
-	// close socket
-	ret = close(fd);
-	LWIP_ASSERT("ret == 0", ret == 0);
-	xEventGroupSetBits( xEventGroup, HTTP_CLOSE_BIT );
 	ESP_LOGI(pcTaskGetName(0), "Finish");
 	vTaskDelete(NULL);
 }
 
+#if CONFIG_STATS_BROADCAST
+// Stats packet, little endian. stats_receive.py decodes it.
+#define STATS_MAGIC		0x31535356	// "VSS1"
+#define STATS_MAX_TASK	24
+
+typedef struct __attribute__((packed)) {
+	char	name[12];
+	uint16_t cpu;						// Permille of one core
+} STATS_TASK_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint32_t sequence;
+	uint32_t uptime;					// Seconds
+	uint16_t period;					// ms since the last packet
+	uint8_t	station;					// Current preset
+	uint8_t	fill;						// Audio buffer fill %
+	uint32_t bufferMs;					// Audio in the buffer
+	uint32_t sdiBytes;					// SDI bytes/s
+	uint32_t dreqWaitMs;				// Time the feeder waited for DREQ in the period
+	uint32_t underruns;
+	uint32_t reconnects;
+	uint32_t heapFree;					// Internal RAM
+	uint32_t heapMin;
+	uint32_t psramFree;
+	uint32_t psramMin;
+	uint8_t	taskCount;
+	STATS_TASK_t task[STATS_MAX_TASK];
+} STATS_PACKET_t;
+
+// CPU of each task since the last call.
+// CONFIG_STATS_BROADCAST selects the FreeRTOS trace facility and run time stats.
+static int stats_tasks(STATS_TASK_t * task) {
+	static TaskStatus_t status[STATS_MAX_TASK];
+	static TaskHandle_t lastHandle[STATS_MAX_TASK];
+	static uint32_t lastCounter[STATS_MAX_TASK];
+	static int lastCount = 0;
+	static uint32_t lastTotal = 0;
+
+	uint32_t total;
+	int count = uxTaskGetSystemState(status, STATS_MAX_TASK, &total);
+	if (count == 0) return 0; // More tasks than STATS_MAX_TASK
+	uint32_t elapsed = total - lastTotal;
+	for (int i=0; i<count; i++) {
+		uint32_t counter = 0;
+		for (int j=0; j<lastCount; j++) {
+			if (lastHandle[j] == status[i].xHandle) counter = lastCounter[j];
+		}
+		strncpy(task[i].name, status[i].pcTaskName, sizeof(task[i].name));
+		task[i].cpu = elapsed ? (uint64_t)(status[i].ulRunTimeCounter - counter) * 1000 / elapsed : 0;
+	}
+	for (int i=0; i<count; i++) {
+		lastHandle[i] = status[i].xHandle;
+		lastCounter[i] = status[i].ulRunTimeCounter;
+	}
+	lastCount = count;
+	lastTotal = total;
+	return count;
+}
+
+static void stats_task(void *pvParameters)
+{
+	ESP_LOGI(pcTaskGetName(0), "Start");
+
+	/* set up address to sendto */
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(CONFIG_STATS_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_BROADCAST); /* send message to 255.255.255.255 */
+
+	int fd = lwip_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP ); // Create a UDP socket.
+	LWIP_ASSERT("fd >= 0", fd >= 0);
+
+	static STATS_PACKET_t packet;
+	memset(&packet, 0, sizeof(packet));
+	packet.magic = STATS_MAGIC;
+	uint32_t lastSdiBytes = 0;
+	uint32_t lastDreqWaitUs = 0;
+	int64_t lastTime = esp_timer_get_time();
+	stats_tasks(packet.task);
+	while (1) {
+		vTaskDelay(pdMS_TO_TICKS(CONFIG_STATS_INTERVAL * 1000));
+		int64_t now = esp_timer_get_time();
+		uint32_t elapsedMs = (now - lastTime) / 1000;
+		lastTime = now;
+
+		packet.sequence++;
+		packet.uptime = now / 1000000;
+		packet.period = elapsedMs;
+		packet.station = stationIndex();
+		packet.fill = (uint64_t)ringFill(&audioRing) * 100 / audioRing.size;
+		packet.bufferMs = ringFillMs(&audioRing);
+		if (player) {
+			// The counters wrap, the differences don't
+			uint32_t sdiBytes = player->sdiTotalBytes;
+			uint32_t dreqWaitUs = player->dreqTotalWaitUs;
+			packet.sdiBytes = elapsedMs ? (uint64_t)(sdiBytes - lastSdiBytes) * 1000 / elapsedMs : 0;
+			packet.dreqWaitMs = (dreqWaitUs - lastDreqWaitUs) / 1000;
+			lastSdiBytes = sdiBytes;
+			lastDreqWaitUs = dreqWaitUs;
+		}
+		packet.underruns = playback.underruns;
+		packet.reconnects = clientReconnects;
+		packet.heapFree = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+		packet.heapMin = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+		packet.psramFree = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+		packet.psramMin = heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM);
+		packet.taskCount = stats_tasks(packet.task);
+
+		size_t length = offsetof(STATS_PACKET_t, task) + packet.taskCount * sizeof(STATS_TASK_t);
+		int ret = lwip_sendto(fd, &packet, length, 0, (struct sockaddr *)&addr, sizeof(addr));
+		if (ret != length) ESP_LOGW(pcTaskGetName(0), "sendto fail errno=%d", errno);
+	}
+
+	/* close socket. Don't reach here.*/
+	lwip_close(fd);
+	ESP_LOGI(pcTaskGetName(0), "Finish");
+	vTaskDelete( NULL );
+}
+#endif
+
 void app_main(void)
 {
 	// Initialize NVS
@@ -875,27 +1267,48 @@ void app_main(void)
 	// The remaining 160KB (for a total of 320KB of DRAM) can only be allocated at runtime as heap.
 	xRingbufferConsole = xRingbufferCreate(xRingbufferConsoleSize, RINGBUF_TYPE_NOSPLIT);
 	xRingbufferBroadcast = xRingbufferCreate(xRingbufferBroadcastSize, RINGBUF_TYPE_NOSPLIT);
-	xMessageBuffer = xMessageBufferCreate(xMessageBufferSize);
 	configASSERT( xRingbufferConsole );
 	configASSERT( xRingbufferBroadcast );
-	configASSERT( xMessageBuffer );
-	size_t freeSize = xMessageBufferSpacesAvailable( xMessageBuffer );
-	ESP_LOGI(TAG, "freeSize=%d", freeSize);
+	// The audio buffer can live in PSRAM, leaving DRAM for WiFi/lwIP.
+	if (ringInit(&audioRing, xAudioRingSize, xAudioRingCaps) == false) {
+		while(1) vTaskDelay(10);
+	}
+	ringSetRefill(&audioRing, CONFIG_AUDIO_REFILL_MS);
+	ESP_LOGI(TAG, "freeSize=%ld", xAudioRingSize);
+#if CONFIG_AUDIO_BUFFER_PSRAM
+	ringMeasureCopy(&audioRing);
+#endif
 
 	// Create Eventgroup
 	xEventGroup = xEventGroupCreate();
 	configASSERT( xEventGroup );
 
-	//xTaskCreate(&vs1053_task, "VS1053", 1024*8, NULL, 4, NULL);
-	xTaskCreate(&vs1053_task, "VS1053", 1024*8, NULL, 5, NULL);
-	xTaskCreate(&client_task, "CLIENT", 1024*10, NULL, 4, NULL);
+	// Load station presets
+	stationInit();
+
+#if CONFIG_LATENCY_TRACE
+	traceInit(&audioRing);
+	taskCreate(&traceTask, "TRACE", TRACE_STACK, 1, NETWORK_CORE);
+#endif
+
+	// spi_master_init() runs in vs1053_task, so the DREQ interrupt lands on FEEDER_CORE
+	taskCreate(&vs1053_task, "VS1053", VS1053_STACK, 5, FEEDER_CORE);
+	taskCreate(&client_task, "CLIENT", CLIENT_STACK, 4, NETWORK_CORE);
 
 #if CONFIG_METADATA_CONSOLE || CONFIG_METADATA_BOTH
-	xTaskCreate(&console_task, "CONSOLE", 1024*4, NULL, 3, NULL);
+	taskCreate(&console_task, "CONSOLE", METADATA_STACK, 3, NETWORK_CORE);
 #endif
 
 #if CONFIG_METADATA_BROADCAST || CONFIG_METADATA_BOTH
-	xTaskCreate(&udp_task, "BROADCAST", 1024*4, NULL, 3, NULL);
+	taskCreate(&udp_task, "BROADCAST", METADATA_STACK, 3, NETWORK_CORE);
+#endif
+
+#if CONFIG_STATS_BROADCAST
+	taskCreate(&stats_task, "STATS", METADATA_STACK, 2, NETWORK_CORE);
+#endif
+
+#if CONFIG_STATION_PRECONNECT
+	taskCreate(&stationPreconnectTask, "PRECONNECT", PRECONNECT_STACK, 2, NETWORK_CORE);
 #endif
 
 
@@ -905,29 +1318,25 @@ void app_main(void)
 #else
 #if CONFIG_IR_PROTOCOL_NEC 
 	ESP_LOGI(TAG, "Your remote is NEC");
-	xTaskCreate(&ir_rx_task, "NEC", 1024*2, NULL, 3, NULL);
+	taskCreate(&ir_rx_task, "NEC", IR_STACK, 3, NETWORK_CORE);
 #endif
 #if CONFIG_IR_PROTOCOL_RC5
 	ESP_LOGI(TAG, "Your remote is RC5");
-	xTaskCreate(&ir_rx_task, "RC5", 1024*2, NULL, 3, NULL);
+	taskCreate(&ir_rx_task, "RC5", IR_STACK, 3, NETWORK_CORE);
 #endif
 	ESP_LOGI(TAG, "CONFIG_ADDR_ON=0x%x", CONFIG_IR_ADDR_ON);
 	ESP_LOGI(TAG, "CONFIG_CMD_ON=0x%x", CONFIG_IR_CMD_ON);
 	ESP_LOGI(TAG, "CONFIG_ADDR_OFF=0x%x", CONFIG_IR_ADDR_OFF);
 	ESP_LOGI(TAG, "CONFIG_CMD_OFF=0x%x", CONFIG_IR_CMD_OFF);
+	ESP_LOGI(TAG, "CONFIG_ADDR_NEXT=0x%x", CONFIG_IR_ADDR_NEXT);
+	ESP_LOGI(TAG, "CONFIG_CMD_NEXT=0x%x", CONFIG_IR_CMD_NEXT);
+	ESP_LOGI(TAG, "CONFIG_ADDR_PREV=0x%x", CONFIG_IR_ADDR_PREV);
+	ESP_LOGI(TAG, "CONFIG_CMD_PREV=0x%x", CONFIG_IR_CMD_PREV);
+	ESP_LOGI(TAG, "CONFIG_ADDR_VOLUP=0x%x", CONFIG_IR_ADDR_VOLUP);
+	ESP_LOGI(TAG, "CONFIG_CMD_VOLUP=0x%x", CONFIG_IR_CMD_VOLUP);
+	ESP_LOGI(TAG, "CONFIG_ADDR_VOLDOWN=0x%x", CONFIG_IR_ADDR_VOLDOWN);
+	ESP_LOGI(TAG, "CONFIG_CMD_VOLDOWN=0x%x", CONFIG_IR_CMD_VOLDOWN);
 	xEventGroupSetBits( xEventGroup, PLAY_START_BIT );
 #endif
 
-	// Restart client task, if it stop.
-	while(1) {
-		xEventGroupWaitBits( xEventGroup,
-			HTTP_CLOSE_BIT,		/* The bits within the event group to wait for. */
-			pdTRUE,				/* HTTP_CLOSE_BIT should be cleared before returning. */
-			pdFALSE,			/* Don't wait for both bits, either bit will do. */
-			portMAX_DELAY);		/* Wait forever. */
-		ESP_LOGI(TAG, "HTTP_CLOSE_BIT");
-		xTaskCreate(&client_task, "CLIENT", 1024*8, NULL, 5, NULL);
-		xEventGroupSetBits( xEventGroup, HTTP_RESUME_BIT );
-	}
-
 }
@@ -0,0 +1,308 @@
+/* Radio station presets and connections
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+
+#include "station.h"
+
+static const char *TAG = "STATION";
+
+static URL_t stations[MAX_STATION];
+static int stationNumber = 0;
+static int stationCurrent = 0;
+
+#define DNS_CACHE_SIZE 4
+
+// gethostbyname() doesn't tell the TTL, so entries expire after CONFIG_DNS_CACHE_TTL.
+typedef struct {
+	char	host[MAX_URL_HOST];
+	struct in_addr addr;
+	int64_t	expires;
+} DNS_CACHE_t;
+
+static DNS_CACHE_t dnsCache[DNS_CACHE_SIZE];
+
+// The client and the preconnect task share the DNS cache and the preconnected sockets
+static SemaphoreHandle_t stationLock;
+
+#if CONFIG_STATION_PRECONNECT
+#define PRECONNECT_CHECK_MS 1000				// How often the idle connection is checked
+#define PRECONNECT_RETRY_MS 10000				// Wait after a failed connection
+
+#define PRECONNECT_MAX 2						// The next and the previous preset
+
+typedef struct {
+	URL_t	want;								// Where stationPreconnect() asked for
+	bool	wanted;
+	int		fd;
+	URL_t	url;								// Where fd goes
+} PRECONNECT_t;
+
+static TaskHandle_t preconnectTask = NULL;
+static PRECONNECT_t preconnect[PRECONNECT_MAX] = { { .fd = -1 }, { .fd = -1 } };
+#endif
+
+// Update url from http://host[:port][/path] or an absolute path.
+// https is not supported.
+bool parseUrl(URL_t * url, const char * location) {
+	const char *sp = location;
+	if (strncasecmp(location, "http://", 7) == 0) {
+		const char *host = location + 7;
+		size_t hostLength = strcspn(host, ":/,");
+		if (hostLength == 0 || hostLength >= MAX_URL_HOST) return false;
+		memcpy(url->host, host, hostLength);
+		url->host[hostLength] = 0;
+		url->port = 80;
+		sp = host + hostLength;
+		if (*sp == ':') {
+			char *end;
+			url->port = strtol(sp+1, &end, 10);
+			sp = end;
+		}
+		if (*sp == 0 || *sp == ',') sp = "/";
+	}
+	if (*sp != '/') return false;
+	size_t pathLength = strcspn(sp, ",");
+	if (pathLength >= MAX_URL_PATH) return false;
+	memcpy(url->path, sp, pathLength);
+	url->path[pathLength] = 0;
+	return true;
+}
+
+// Preset 0 is CONFIG_SERVER_HOST, the others come from CONFIG_SERVER_PRESETS.
+void stationInit(void) {
+	stationLock = xSemaphoreCreateMutex();
+	configASSERT( stationLock );
+
+	strlcpy(stations[0].host, CONFIG_SERVER_HOST, MAX_URL_HOST);
+	stations[0].port = CONFIG_SERVER_PORT;
+	strlcpy(stations[0].path, CONFIG_SERVER_PATH, MAX_URL_PATH);
+	stationNumber = 1;
+
+	const char *sp = CONFIG_SERVER_PRESETS;
+	while (*sp && stationNumber < MAX_STATION) {
+		while (*sp == ' ' || *sp == ',') sp++;
+		if (*sp == 0) break;
+		if (parseUrl(&stations[stationNumber], sp)) {
+			ESP_LOGI(TAG, "Preset %d http://%s:%d%s", stationNumber,
+				stations[stationNumber].host, stations[stationNumber].port, stations[stationNumber].path);
+			stationNumber++;
+		} else {
+			ESP_LOGW(TAG, "Unsupported preset %s", sp);
+		}
+		sp += strcspn(sp, ",");
+	}
+}
+
+int stationCount(void) {
+	return stationNumber;
+}
+
+int stationIndex(void) {
+	return stationCurrent;
+}
+
+URL_t * stationGet(int index) {
+	return &stations[index % stationNumber];
+}
+
+int stationSelect(int delta) {
+	stationCurrent = (stationCurrent + stationNumber + delta) % stationNumber;
+	return stationCurrent;
+}
+
+static bool station_resolve(const char * host, struct in_addr * addr) {
+	if (inet_aton(host, addr)) return true;
+
+	int64_t now = esp_timer_get_time();
+	xSemaphoreTake(stationLock, portMAX_DELAY);
+	for (int i=0; i<DNS_CACHE_SIZE; i++) {
+		if (strcmp(dnsCache[i].host, host) == 0 && dnsCache[i].expires > now) {
+			*addr = dnsCache[i].addr;
+			xSemaphoreGive(stationLock);
+			ESP_LOGD(TAG, "DNS cache hit %s", host);
+			return true;
+		}
+	}
+	xSemaphoreGive(stationLock);
+
+	// gethostbyname() blocks, so the lock isn't held
+	struct hostent *hostent = gethostbyname(host);
+	if (hostent == NULL) {
+		ESP_LOGE(TAG, "DNS lookup failed. Check %s", host);
+		return false;
+	}
+	memcpy(addr, hostent->h_addr_list[0], sizeof(struct in_addr));
+
+	// Replace the entry of host, or the oldest one
+	xSemaphoreTake(stationLock, portMAX_DELAY);
+	DNS_CACHE_t *entry = &dnsCache[0];
+	for (int i=0; i<DNS_CACHE_SIZE; i++) {
+		if (strcmp(dnsCache[i].host, host) == 0) {
+			entry = &dnsCache[i];
+			break;
+		}
+		if (dnsCache[i].expires < entry->expires) entry = &dnsCache[i];
+	}
+	strlcpy(entry->host, host, MAX_URL_HOST);
+	entry->addr = *addr;
+	entry->expires = now + CONFIG_DNS_CACHE_TTL * 1000000LL;
+	xSemaphoreGive(stationLock);
+	ESP_LOGI(TAG, "DNS lookup success %s", host);
+	return true;
+}
+
+static int station_open(URL_t * url) {
+	struct sockaddr_in server;
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(url->port);
+	if (!station_resolve(url->host, &server.sin_addr)) return -1;
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		ESP_LOGE(TAG, "socket fail errno=%d", errno);
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr*)&server, sizeof(server)) != 0) {
+		ESP_LOGE(TAG, "connect %s:%d fail errno=%d", url->host, url->port, errno);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+#if CONFIG_STATION_PRECONNECT
+static bool station_same(URL_t * a, URL_t * b) {
+	return (a->port == b->port && strcmp(a->host, b->host) == 0);
+}
+
+// The server hasn't closed the idle connection
+static bool station_alive(int fd) {
+	char c;
+	return (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+// Take a prepared connection if one goes to url and the server hasn't closed it.
+static int station_take_preconnect(URL_t * url) {
+	int fd = -1;
+	xSemaphoreTake(stationLock, portMAX_DELAY);
+	for (int i=0; i<PRECONNECT_MAX && fd < 0; i++) {
+		if (preconnect[i].fd >= 0 && station_same(url, &preconnect[i].url) && station_alive(preconnect[i].fd)) {
+			fd = preconnect[i].fd;
+			preconnect[i].fd = -1;
+		}
+	}
+	xSemaphoreGive(stationLock);
+	if (fd >= 0) ESP_LOGI(TAG, "Use preconnected %s:%d", url->host, url->port);
+	return fd;
+}
+
+// Doesn't block. The connections are made by stationPreconnectTask().
+// prev may be NULL, or the same as next when there are two presets.
+void stationPreconnect(URL_t * next, URL_t * prev) {
+	xSemaphoreTake(stationLock, portMAX_DELAY);
+	preconnect[0].want = *next;
+	preconnect[0].wanted = true;
+	preconnect[1].wanted = (prev != NULL && !station_same(prev, next));
+	if (preconnect[1].wanted) preconnect[1].want = *prev;
+	xSemaphoreGive(stationLock);
+	if (preconnectTask) xTaskNotifyGive(preconnectTask);
+}
+
+/**
+ * Keep a live connection to each url of the last stationPreconnect().
+ *
+ * DNS and connect block in this task, not in the client. A connection is
+ * kept while the server keeps it open, and made again when the server closes
+ * it or stationConnect() takes it. One that isn't wanted anymore is closed.
+ */
+void stationPreconnectTask(void *pvParameters) {
+	preconnectTask = xTaskGetCurrentTaskHandle();
+	while (1) {
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PRECONNECT_CHECK_MS));
+		bool failed = false;
+		for (int i=0; i<PRECONNECT_MAX; i++) {
+			xSemaphoreTake(stationLock, portMAX_DELAY);
+			URL_t url = preconnect[i].want;
+			bool wanted = preconnect[i].wanted;
+			bool ready = (preconnect[i].fd >= 0 && station_same(&url, &preconnect[i].url) && station_alive(preconnect[i].fd));
+			if (!wanted && preconnect[i].fd >= 0) {
+				close(preconnect[i].fd);
+				preconnect[i].fd = -1;
+			}
+			xSemaphoreGive(stationLock);
+			if (!wanted || ready) continue;
+
+			int fd = station_open(&url);
+			xSemaphoreTake(stationLock, portMAX_DELAY);
+			if (preconnect[i].fd >= 0) close(preconnect[i].fd);
+			preconnect[i].fd = fd;
+			preconnect[i].url = url;
+			xSemaphoreGive(stationLock);
+			if (fd < 0) failed = true;
+		}
+		if (failed) vTaskDelay(pdMS_TO_TICKS(PRECONNECT_RETRY_MS));
+	}
+}
+#else
+void stationPreconnect(URL_t * next, URL_t * prev) {
+}
+#endif
+
+/**
+ * Connect to url and send the request.
+ *
+ * The request is built in buffer and sent with one send().
+ * @return socket, or -1 on failure
+ */
+int stationConnect(URL_t * url, char * buffer, size_t size) {
+	int fd = -1;
+#if CONFIG_STATION_PRECONNECT
+	fd = station_take_preconnect(url);
+#endif
+	if (fd < 0) fd = station_open(url);
+	if (fd < 0) return -1;
+
+	// receive icy-metadata
+	// https://stackoverflow.com/questions/44050266/get-info-from-streaming-radio
+	// The port is part of Host unless it is the default one
+	char port[8] = "";
+	if (url->port != 80) snprintf(port, sizeof(port), ":%u", url->port);
+	int length = snprintf(buffer, size,
+		"GET %s HTTP/1.1\r\n"
+		"HOST: %s%s\r\n"
+		"User-Agent: ESP32/1.00\r\n"
+		"Icy-MetaData: 1\r\n"
+		"Connection: close\r\n"
+		"\r\n", url->path, url->host, port);
+	if (length >= size) {
+		ESP_LOGE(TAG, "Request too long");
+		close(fd);
+		return -1;
+	}
+	int ret = send(fd, buffer, length, 0);
+	if (ret != length) {
+		ESP_LOGE(TAG, "send fail ret=%d errno=%d", ret, errno);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
@@ -0,0 +1,37 @@
+/* Radio station presets and connections
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef MAIN_STATION_H_
+#define MAIN_STATION_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MAX_URL_HOST 64
+#define MAX_URL_PATH 256
+#define MAX_STATION 8
+
+typedef struct {
+	char	host[MAX_URL_HOST];
+	uint16_t port;
+	char	path[MAX_URL_PATH];
+} URL_t;
+
+bool parseUrl(URL_t * url, const char * location);          // http://host[:port][/path] or /path
+void stationInit(void);                                     // Load the presets
+int stationCount(void);
+int stationIndex(void);                                     // Current preset
+URL_t * stationGet(int index);
+int stationSelect(int delta);                               // Step to the next (1) or previous (-1) preset
+int stationConnect(URL_t * url, char * buffer, size_t size); // Connect and send the request, returns the socket
+void stationPreconnect(URL_t * next, URL_t * prev);         // Keep connections to next and prev ready
+void stationPreconnectTask(void *pvParameters);             // Makes the connection for stationPreconnect()
+
+#endif /* MAIN_STATION_H_ */
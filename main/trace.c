@@ -0,0 +1,225 @@
+/* Audio pipeline latency trace
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include "sdkconfig.h"
+
+#if CONFIG_LATENCY_TRACE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+
+#include "trace.h"
+
+static const char *TAG = "TRACE";
+
+// The trace points only stamp the time into the ring. The trace task pairs
+// them up, so the audio path doesn't pay for the statistics.
+// The CPU cycle counters of the two cores aren't in step, and the trace points
+// run on both of them, so the stamps come from the 1 us esp_timer.
+#define TRACE_RING_SIZE     512             // Power of two
+#define TRACE_PENDING_SIZE  64              // Committed blocks not played yet
+#define TRACE_BUCKETS       20              // <16us, <32us ... >=4s
+#define TRACE_PERIOD_MS     100
+#define TRACE_DUMP_MS       10000
+#define TRACE_OCCUPANCY     (TRACE_DUMP_MS / 1000)
+
+typedef struct {
+	atomic_uint sequence;                   // Index + 1 once the event is written
+	uint32_t time;
+	uint32_t offset;
+	uint8_t point;
+} TRACE_EVENT_t;
+
+typedef struct {
+	uint32_t offset;                        // Ring head after the commit
+	uint32_t commitTime;
+	uint32_t recvTime;
+} TRACE_PENDING_t;
+
+// Stages between the trace points
+#define STAGE_RECV  0                       // recv() to commit
+#define STAGE_RING  1                       // commit to the feeder
+#define STAGE_SDI   2                       // feeder to the VS1053
+#define STAGE_TOTAL 3                       // recv() to the VS1053
+#define STAGES      4
+
+static const char *stageName[STAGES] = { "recv", "ring", "sdi", "total" };
+
+static TRACE_EVENT_t traceRing[TRACE_RING_SIZE];
+static atomic_uint traceHead;
+static uint32_t traceTail;
+static uint32_t traceLost;
+
+static AUDIO_RING_t *audioRing;
+static TRACE_PENDING_t pending[TRACE_PENDING_SIZE];
+static int pendingHead, pendingCount;
+static uint32_t recvTime, readTime, readRecvTime;
+static uint32_t histogram[STAGES][TRACE_BUCKETS];
+static uint32_t occupancy[TRACE_OCCUPANCY];
+
+void traceEvent(uint8_t point, uint32_t offset) {
+	unsigned index = atomic_fetch_add_explicit(&traceHead, 1, memory_order_relaxed);
+	TRACE_EVENT_t *event = &traceRing[index % TRACE_RING_SIZE];
+	atomic_store_explicit(&event->sequence, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	event->time = esp_timer_get_time();
+	event->offset = offset;
+	event->point = point;
+	atomic_store_explicit(&event->sequence, index + 1, memory_order_release);
+}
+
+static void trace_add(int stage, uint32_t us) {
+	int bucket = 0;
+	while (bucket < TRACE_BUCKETS - 1 && us >= (16u << bucket)) bucket++;
+	histogram[stage][bucket]++;
+}
+
+static void trace_pair(TRACE_EVENT_t * event) {
+	switch (event->point) {
+	case TRACE_RECV:
+		if (recvTime == 0) recvTime = event->time;
+		break;
+	case TRACE_COMMIT:
+		if (recvTime == 0) break;
+		trace_add(STAGE_RECV, event->time - recvTime);
+		if (pendingCount == TRACE_PENDING_SIZE) {
+			pendingHead = (pendingHead + 1) % TRACE_PENDING_SIZE; // Drop the oldest
+			pendingCount--;
+		}
+		TRACE_PENDING_t *block = &pending[(pendingHead + pendingCount) % TRACE_PENDING_SIZE];
+		block->offset = event->offset;
+		block->commitTime = event->time;
+		block->recvTime = recvTime;
+		pendingCount++;
+		recvTime = 0;
+		break;
+	case TRACE_READ:
+	case TRACE_DISCARD:
+		// Blocks that ended before offset have reached the feeder
+		while (pendingCount && (int32_t)(pending[pendingHead].offset - event->offset) <= 0) {
+			if (event->point == TRACE_READ) {
+				trace_add(STAGE_RING, event->time - pending[pendingHead].commitTime);
+				readRecvTime = pending[pendingHead].recvTime;
+			}
+			pendingHead = (pendingHead + 1) % TRACE_PENDING_SIZE;
+			pendingCount--;
+		}
+		readTime = (event->point == TRACE_READ) ? event->time : 0;
+		break;
+	case TRACE_SENT:
+		if (readTime) trace_add(STAGE_SDI, event->time - readTime);
+		if (readRecvTime) trace_add(STAGE_TOTAL, event->time - readRecvTime);
+		readTime = 0;
+		readRecvTime = 0;
+		break;
+	}
+}
+
+static void trace_drain(void) {
+	unsigned head = atomic_load_explicit(&traceHead, memory_order_relaxed);
+	if (head - traceTail > TRACE_RING_SIZE) {
+		// Overwritten before the trace task got to them
+		traceLost += head - traceTail - TRACE_RING_SIZE;
+		traceTail = head - TRACE_RING_SIZE;
+	}
+	while (traceTail != head) {
+		TRACE_EVENT_t *event = &traceRing[traceTail % TRACE_RING_SIZE];
+		if (atomic_load_explicit(&event->sequence, memory_order_acquire) != traceTail + 1) break; // Still being written
+		TRACE_EVENT_t copy = *event;
+		// The writer may have lapped us while we copied
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&event->sequence, memory_order_acquire) != traceTail + 1) break;
+		trace_pair(&copy);
+		traceTail++;
+	}
+}
+
+// snprintf at length, which stops at the end of buffer
+static void trace_append(char * buffer, size_t size, size_t * length, const char * format, ...) {
+	if (*length >= size - 1) return;
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(&buffer[*length], size - *length, format, args);
+	va_end(args);
+	if (n < 0) return;
+	*length += n;
+	if (*length > size - 1) *length = size - 1;
+}
+
+static size_t trace_format(char * buffer, size_t size) {
+	size_t length = 0;
+	trace_append(buffer, size, &length, "latency us, %"PRIu32" events lost\n", traceLost);
+	for (int stage=0; stage<STAGES; stage++) {
+		trace_append(buffer, size, &length, "%s", stageName[stage]);
+		for (int i=0; i<TRACE_BUCKETS; i++) {
+			if (histogram[stage][i] == 0) continue;
+			trace_append(buffer, size, &length, " %s%u:%"PRIu32,
+				(i == TRACE_BUCKETS - 1) ? ">=" : "<", (i == TRACE_BUCKETS - 1) ? (16u << (i-1)) : (16u << i),
+				histogram[stage][i]);
+		}
+		trace_append(buffer, size, &length, "\n");
+	}
+	trace_append(buffer, size, &length, "buffer ms");
+	for (int i=0; i<TRACE_OCCUPANCY; i++) {
+		trace_append(buffer, size, &length, " %"PRIu32, occupancy[i]);
+	}
+	trace_append(buffer, size, &length, "\n");
+	return length;
+}
+
+void traceTask(void *pvParameters)
+{
+	ESP_LOGI(pcTaskGetName(0), "Start");
+#if CONFIG_LATENCY_TRACE_UDP
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(CONFIG_LATENCY_TRACE_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+	int fd = lwip_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	LWIP_ASSERT("fd >= 0", fd >= 0);
+#endif
+	static char buffer[1024];
+	int ticks = 0;
+	while (1) {
+		vTaskDelay(pdMS_TO_TICKS(TRACE_PERIOD_MS));
+		trace_drain();
+		ticks++;
+		// Buffer occupancy once a second
+		if (ticks % (1000 / TRACE_PERIOD_MS) == 0) {
+			occupancy[(ticks / (1000 / TRACE_PERIOD_MS) - 1) % TRACE_OCCUPANCY] = ringFillMs(audioRing);
+		}
+		if (ticks < TRACE_DUMP_MS / TRACE_PERIOD_MS) continue;
+
+		size_t length = trace_format(buffer, sizeof(buffer));
+		ESP_LOGI(pcTaskGetName(0), "\n%.*s", (int)length, buffer);
+#if CONFIG_LATENCY_TRACE_UDP
+		lwip_sendto(fd, buffer, length, 0, (struct sockaddr *)&addr, sizeof(addr));
+#endif
+		memset(histogram, 0, sizeof(histogram));
+		traceLost = 0;
+		ticks = 0;
+	}
+}
+
+void traceInit(AUDIO_RING_t * ring) {
+	audioRing = ring;
+	atomic_init(&traceHead, 0);
+	for (int i=0; i<TRACE_RING_SIZE; i++) atomic_init(&traceRing[i].sequence, 0);
+}
+
+#endif
@@ -0,0 +1,32 @@
+/* Audio pipeline latency trace
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef MAIN_TRACE_H_
+#define MAIN_TRACE_H_
+
+#include <stdint.h>
+#include "audio_ring.h"
+
+// Trace points, in the order a byte passes them
+#define TRACE_RECV      0                   // recv() returned a block
+#define TRACE_COMMIT    1                   // Block committed to the audio ring, offset is the ring head
+#define TRACE_READ      2                   // Feeder took a span, offset is the end of the span
+#define TRACE_SENT      3                   // playChunk() returned
+#define TRACE_DISCARD   4                   // Feeder dropped the ring up to offset
+
+#if CONFIG_LATENCY_TRACE
+void traceInit(AUDIO_RING_t * ring);                        // Call before traceTask is created
+void traceTask(void *pvParameters);                         // Logs the latency histograms
+void traceEvent(uint8_t point, uint32_t offset);            // Record a trace point, from any task
+#define TRACE(point, offset) traceEvent(point, offset)
+#else
+#define TRACE(point, offset)
+#endif
+
+#endif /* MAIN_TRACE_H_ */
@@ -33,6 +33,7 @@
  */
 
 
+#include <stdio.h>
 #include <string.h>
 #include <math.h>
 
@@ -42,20 +43,50 @@
 #include <driver/spi_master.h>
 #include <driver/gpio.h>
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "soc/soc.h"
+#include "nvs.h"
 
 #include "vs1053.h"
+#include "audio_frame.h"
 
 #define TAG "VS1053"
 #define _DEBUG_ 0
 
-static const int GPIO_SCLK = 18;
-static const int GPIO_MISO = 19;
-static const int GPIO_MOSI = 23;
+// SPI hosts used by VS1053 instances, indexed by spi_host_device_t
+// An ESP32 SPI host has 3 CS slots and each VS1053 takes two (SCI and SDI),
+// so there is one VS1053 per host. Nothing else shares its bus, so a software
+// CS needs no bus lock.
+static bool vs1053_host_used[3];
+static portMUX_TYPE vs1053_bus_mux = portMUX_INITIALIZER_UNLOCKED;
+
+#if CONFIG_CLOCK_CALIBRATION
+// SCI_CLOCKF candidates for VS1053, slowest first
+static const uint16_t CLOCKF_Candidates[] = {
+	0x6000, // 3.0x
+	0x8000, // 3.5x
+	0x8800, // 3.5x + 1.0x
+	0xA000, // 4.0x
+	0xA800, // 4.0x + 1.0x
+	0xC000, // 4.5x
+	0xC800, // 4.5x + 1.0x
+};
+
+// SDI clock candidates, slowest first
+static const int SPI_Frequency_Candidates[] = {
+	VS1053_SDI_FREQ,
+	SPI_MASTER_FREQ_8M,
+	SPI_MASTER_FREQ_10M,
+	SPI_MASTER_FREQ_11M,
+	SPI_MASTER_FREQ_13M,
+};
+
+// Registers that can be scribbled on during calibration
+static const uint8_t CalibrationRegs[] = { SCI_VOL, SCI_AICTRL0, SCI_AICTRL1, SCI_AICTRL2, SCI_AICTRL3 };
+#endif
 
-//static const int SPI_Frequency = SPI_MASTER_FREQ_20M;
-//static const int SPI_Frequency = SPI_MASTER_FREQ_26M;
-//static const int SPI_Frequency = SPI_MASTER_FREQ_40M;
-//static const int SPI_Frequency = SPI_MASTER_FREQ_80M;
+#define NVS_NAMESPACE "vs1053"
 
 void delay(int ms) {
 	int _ms = ms + (portTICK_PERIOD_MS - 1);
@@ -66,9 +97,288 @@ void delay(int ms) {
 }
 
 
-void spi_master_init(VS1053_t * dev, int16_t GPIO_CS, int16_t GPIO_DCS, int16_t GPIO_DREQ, int16_t GPIO_RESET)
+static void IRAM_ATTR dreq_isr_handler(void *arg)
+{
+	VS1053_t *dev = (VS1053_t *)arg;
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+	TaskHandle_t task = dev->dreqTask;
+	if (task != NULL) {
+		dev->dreqRiseUs = esp_timer_get_time();
+		vTaskNotifyGiveFromISR(task, &xHigherPriorityTaskWoken);
+	}
+	if (xHigherPriorityTaskWoken) portYIELD_FROM_ISR();
+}
+
+// CLKI selected by SC_MULT of a SCI_CLOCKF value
+static int clki_freq(VS1053_t * dev, uint16_t clockf)
+{
+	int mult2 = (clockf >> 13) & 7; // SC_MULT, CLKI = XTALI * mult2 / 2
+	if (dev->chipVersion == 3) {
+		mult2 = mult2 + 2; // VS1003: 1.0, 1.5 ... 4.5
+	} else {
+		mult2 = (mult2 == 0) ? 2 : mult2 + 3; // VS1053: 1.0, 2.0, 2.5 ... 5.0
+	}
+	return VS1053_XTALI / 2 * mult2;
+}
+
+// Fastest SCI clock allowed by a SCI_CLOCKF value.
+// SCI reads are limited to CLKI/7, writes to CLKI/4.
+static int sci_max_clock(VS1053_t * dev, uint16_t clockf)
+{
+	int max = clki_freq(dev, clockf) / 7;
+	// The SPI master clock is APB_CLK_FREQ / n, stay at or below the limit
+	return APB_CLK_FREQ / ((APB_CLK_FREQ + max - 1) / max);
+}
+
+// (Re)create the SCI device at the given clock
+static void sci_set_clock(VS1053_t * dev, int freq)
+{
+	esp_err_t ret;
+
+	if (dev->SPIHandleSci != NULL && dev->sciFreq == freq) return;
+	spi_device_interface_config_t devcfg={
+		.clock_speed_hz = freq,
+		.command_bits = 8,
+		.address_bits = 8,
+		.dummy_bits = 0,
+		.duty_cycle_pos = 0,
+		.cs_ena_pretrans = 0,
+		.cs_ena_posttrans = 1,
+		.flags = SPI_DEVICE_NO_DUMMY,
+		.mode = 0,
+		.spics_io_num = -1,
+		.queue_size = 1
+	};
+#if CONFIG_CS_HARDWARE
+	// The SCI device owns XCS
+	devcfg.cs_ena_pretrans = 1;
+	devcfg.spics_io_num = dev->cs_pin;
+#endif
+
+	if (dev->SPIHandleSci != NULL) {
+		ret = spi_bus_remove_device( dev->SPIHandleSci );
+		assert(ret==ESP_OK);
+	}
+	ret = spi_bus_add_device( dev->host, &devcfg, &dev->SPIHandleSci);
+	ESP_LOGD(TAG, "spi_bus_add_device=%d",ret);
+	assert(ret==ESP_OK);
+	dev->sciFreq = freq;
+	ESP_LOGI(TAG, "SCI clock %d Hz", freq);
+}
+
+// Status reads from other tasks go through the bus owner
+static uint16_t sci_read_status(VS1053_t * dev, uint8_t reg)
+{
+	uint16_t value = 0;
+	sciQueueRead(dev, reg, &value, VS1053_PRIO_TELEMETRY, portMAX_DELAY);
+	return value;
+}
+
+// Average time of one SCI register read, through the SCI queue from other tasks
+static int64_t sci_access_us(VS1053_t * dev)
+{
+	int64_t start = esp_timer_get_time();
+	for (int i = 0; i < 16; i++) {
+		sci_read_status(dev, SCI_STATUS);
+	}
+	return (esp_timer_get_time() - start) / 16;
+}
+
+// NVS keys of one instance, told apart by the XCS pin
+static void clock_profile_keys(VS1053_t * dev, char *clockfKey, char *sdiFreqKey)
+{
+	sprintf(clockfKey, "clockf%d", dev->cs_pin);
+	sprintf(sdiFreqKey, "sdifreq%d", dev->cs_pin);
+}
+
+// Load the clock profile stored by a previous calibration
+static bool clock_profile_load(VS1053_t * dev, uint16_t *clockf, int *sdiFreq)
+{
+	nvs_handle_t handle;
+	char clockfKey[16], sdiFreqKey[16];
+	uint16_t _clockf;
+	uint32_t _sdiFreq;
+
+	clock_profile_keys(dev, clockfKey, sdiFreqKey);
+	if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) return false;
+	esp_err_t ret = nvs_get_u16(handle, clockfKey, &_clockf);
+	if (ret == ESP_OK) ret = nvs_get_u32(handle, sdiFreqKey, &_sdiFreq);
+	nvs_close(handle);
+	if (ret != ESP_OK) return false;
+	*clockf = _clockf;
+	*sdiFreq = _sdiFreq;
+	return true;
+}
+
+static void clock_profile_erase(VS1053_t * dev)
+{
+	nvs_handle_t handle;
+	char clockfKey[16], sdiFreqKey[16];
+
+	clock_profile_keys(dev, clockfKey, sdiFreqKey);
+	if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) return;
+	nvs_erase_key(handle, clockfKey);
+	nvs_erase_key(handle, sdiFreqKey);
+	nvs_commit(handle);
+	nvs_close(handle);
+}
+
+#if CONFIG_CLOCK_CALIBRATION
+// Only a calibration stores a profile
+static void clock_profile_save(VS1053_t * dev, uint16_t clockf, int sdiFreq)
+{
+	nvs_handle_t handle;
+	char clockfKey[16], sdiFreqKey[16];
+
+	clock_profile_keys(dev, clockfKey, sdiFreqKey);
+	esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+	if (ret != ESP_OK) {
+		ESP_LOGW(TAG, "nvs_open fail %s", esp_err_to_name(ret));
+		return;
+	}
+	nvs_set_u16(handle, clockfKey, clockf);
+	nvs_set_u32(handle, sdiFreqKey, sdiFreq);
+	nvs_commit(handle);
+	nvs_close(handle);
+}
+
+// Write test patterns at writeFreq and read them back at the SCI read clock.
+// Same idea as testComm(), but short enough to run for every candidate.
+static bool clock_verify(VS1053_t * dev, int writeFreq, int readFreq)
+{
+	int regs = sizeof(CalibrationRegs);
+	bool ok = true;
+
+	for (int round = 0; round < 8 && ok; round++) {
+		sci_set_clock(dev, writeFreq);
+		for (int i = 0; i < regs; i++) {
+			uint16_t pattern = 0xA55A ^ (round * 0x1111) ^ (i * 0x1357);
+			write_register(dev, CalibrationRegs[i], pattern);
+		}
+		sci_set_clock(dev, readFreq);
+		for (int i = 0; i < regs; i++) {
+			uint16_t pattern = 0xA55A ^ (round * 0x1111) ^ (i * 0x1357);
+			uint16_t r1 = read_register(dev, CalibrationRegs[i]);
+			uint16_t r2 = read_register(dev, CalibrationRegs[i]);
+			if (r1 != r2 || r1 != pattern) ok = false;
+		}
+	}
+	for (int i = 0; i < regs; i++) {
+		write_register(dev, CalibrationRegs[i], 0);
+	}
+	return ok;
+}
+
+// Step through the CLOCKF multipliers and SPI clocks and keep the fastest stable pair.
+// SDI data is write only, so an SPI clock is checked with SCI writes at that clock.
+static void clock_calibrate(VS1053_t * dev, uint16_t *clockf, int *sdiFreq)
+{
+	*clockf = VS1053_CLOCKF;
+	*sdiFreq = VS1053_SDI_FREQ;
+	for (int c = 0; c < sizeof(CLOCKF_Candidates)/sizeof(CLOCKF_Candidates[0]); c++) {
+		write_register(dev, SCI_CLOCKF, CLOCKF_Candidates[c]);
+		delay(1);
+		int readFreq = dev->sciFreq;
+		if (!clock_verify(dev, readFreq, readFreq)) break;
+
+		int freq = 0;
+		int writeMax = clki_freq(dev, CLOCKF_Candidates[c]) / 4; // SDI and SCI writes: CLKI/4
+		for (int f = 0; f < sizeof(SPI_Frequency_Candidates)/sizeof(SPI_Frequency_Candidates[0]); f++) {
+			if (SPI_Frequency_Candidates[f] > writeMax) break;
+			if (!clock_verify(dev, SPI_Frequency_Candidates[f], readFreq)) break;
+			freq = SPI_Frequency_Candidates[f];
+		}
+		ESP_LOGI(TAG, "calibration CLOCKF=0x%04x SDI=%d Hz", CLOCKF_Candidates[c], freq);
+		if (freq == 0) break;
+		*clockf = CLOCKF_Candidates[c];
+		*sdiFreq = freq;
+	}
+	// The last candidate may have failed, come back at a clock that always works
+	sci_set_clock(dev, VS1053_SCI_SLOW);
+}
+#endif
+
+// Log the time spent in one phase of spi_master_init()
+static int64_t boot_phase(const char *name, int64_t start)
+{
+	int64_t now = esp_timer_get_time();
+	ESP_LOGI(TAG, "boot %s %"PRId64" ms", name, (now - start) / 1000);
+	return now;
+}
+
+#if CONFIG_QUICK_START
+// Short replacement for testComm(): chip signature and a few SCI round trips
+static bool quick_check(VS1053_t * dev)
+{
+	static const uint16_t patterns[] = { 0x0000, 0xFFFF, 0xA55A, 0x5AA5 };
+
+	if (!gpio_get_level(dev->dreq_pin)) {
+		ESP_LOGW(TAG, "VS1053 not properly installed!");
+		return false;
+	}
+	uint8_t version = getHardwareVersion(dev);
+	if (version != 3 && version != 4) {
+		ESP_LOGW(TAG, "Unexpected chip version %d", version);
+		return false;
+	}
+	for (int i = 0; i < sizeof(patterns)/sizeof(patterns[0]); i++) {
+		write_register(dev, SCI_VOL, patterns[i]);
+		uint16_t r1 = read_register(dev, SCI_VOL);
+		uint16_t r2 = read_register(dev, SCI_VOL);
+		if (r1 != r2 || r1 != patterns[i]) {
+			ESP_LOGW(TAG, "VS1053 error SB:%04X R1:%04X R2:%04X", patterns[i], r1, r2);
+			return false;
+		}
+	}
+	return true;
+}
+
+// Diagnostics that a normal boot prints before playing
+static void diag_task(void *pvParameters)
+{
+	VS1053_t *dev = (VS1053_t *)pvParameters;
+
+	printDetails(dev, "After last clock setting");
+	ESP_LOGI(TAG, "SCI read %"PRId64" us at %d Hz", sci_access_us(dev), dev->sciFreq);
+	vTaskDelete(NULL);
+}
+#endif
+
+// Initialize the SPI bus. A second VS1053 on the same host is refused.
+static void spi_bus_attach(VS1053_t * dev, int16_t GPIO_SCLK, int16_t GPIO_MISO, int16_t GPIO_MOSI)
+{
+	esp_err_t ret;
+
+	portENTER_CRITICAL(&vs1053_bus_mux);
+	bool first = !vs1053_host_used[dev->host];
+	vs1053_host_used[dev->host] = true;
+	portEXIT_CRITICAL(&vs1053_bus_mux);
+
+	if (!first) {
+		ESP_LOGE(TAG, "SPI host %d already has a VS1053. Use the other SPI host for a second VS1053", dev->host);
+		assert(first);
+	}
+
+	spi_bus_config_t buscfg = {
+		.sclk_io_num = GPIO_SCLK,
+		.mosi_io_num = GPIO_MOSI,
+		.miso_io_num = GPIO_MISO,
+		.quadwp_io_num = -1,
+		.quadhd_io_num = -1,
+		.flags = SPICOMMON_BUSFLAG_MASTER
+	};
+
+	ret = spi_bus_initialize( dev->host, &buscfg, SPI_DMA_CH_AUTO );
+	assert(ret==ESP_OK);
+	ESP_LOGI(TAG, "SPI host %d", dev->host);
+}
+
+void spi_master_init(VS1053_t * dev, spi_host_device_t host, int16_t GPIO_SCLK, int16_t GPIO_MISO, int16_t GPIO_MOSI,
+	int16_t GPIO_CS, int16_t GPIO_DCS, int16_t GPIO_DREQ, int16_t GPIO_RESET)
 {
 	esp_err_t ret;
+	int64_t phase = esp_timer_get_time();
 
 	ESP_LOGI(TAG, "GPIO_DREQ=%d",GPIO_DREQ);
 #if 0
@@ -81,7 +391,7 @@ void spi_master_init(VS1053_t * dev, int16_t GPIO_CS, int16_t GPIO_DCS, int16_t
 	gpio_conf.mode = GPIO_MODE_INPUT;
 	gpio_conf.pull_up_en =	GPIO_PULLUP_DISABLE;
 	gpio_conf.pull_down_en = GPIO_PULLDOWN_ENABLE;
-	gpio_conf.intr_type = GPIO_INTR_DISABLE;   
+	gpio_conf.intr_type = GPIO_INTR_POSEDGE;
 	gpio_conf.pin_bit_mask = ((uint64_t)(((uint64_t)1)<<GPIO_DREQ));
 	ESP_ERROR_CHECK(gpio_config(&gpio_conf));
 #endif
@@ -108,80 +418,163 @@ void spi_master_init(VS1053_t * dev, int16_t GPIO_CS, int16_t GPIO_DCS, int16_t
 		vTaskDelay( pdMS_TO_TICKS( 100 ) );
 		gpio_set_level( GPIO_RESET, 1 );
 	}
+	phase = boot_phase("gpio/reset", phase);
 
-	spi_bus_config_t buscfg = {
-		.sclk_io_num = GPIO_SCLK,
-		.mosi_io_num = GPIO_MOSI,
-		.miso_io_num = GPIO_MISO,
-		.quadwp_io_num = -1,
-		.quadhd_io_num = -1,
-		.flags = SPICOMMON_BUSFLAG_MASTER
-	};
-
-	ret = spi_bus_initialize( HSPI_HOST, &buscfg, 1 );
-	assert(ret==ESP_OK);
+	dev->dreq_pin = GPIO_DREQ;
+	dev->cs_pin = GPIO_CS;
+	dev->dcs_pin = GPIO_DCS;
+	dev->reset_pin = GPIO_RESET;
+	dev->lock = xSemaphoreCreateRecursiveMutex();
+	assert(dev->lock != NULL);
+	dev->host = host;
+	spi_bus_attach(dev, GPIO_SCLK, GPIO_MISO, GPIO_MOSI);
+	phase = boot_phase("spi bus", phase);
 
 	// Init SPI in slow mode
 	//int freq = spi_cal_clock(APB_CLK_FREQ, 1400000, 128, NULL);
 	//ESP_LOGI(TAG,"VS1053 LowFreq: %d",freq);
-	int freq = 200000;
-	spi_device_interface_config_t devcfg={
-		.clock_speed_hz = freq,
-		.command_bits = 8,
-		.address_bits = 8,
-		.dummy_bits = 0,
-		.duty_cycle_pos = 0,
-		.cs_ena_pretrans = 0,
-		.cs_ena_posttrans = 1,
-		.flags = SPI_DEVICE_NO_DUMMY,
-		.mode = 0,
-		.spics_io_num = -1,
-		.queue_size = 1
-	};
-
-	spi_device_handle_t lvsspi;
-	ret = spi_bus_add_device( HSPI_HOST, &devcfg, &lvsspi);
-	ESP_LOGD(TAG, "spi_bus_add_device=%d",ret);
-	assert(ret==ESP_OK);
+	dev->clockf = 0;
+	dev->SPIHandleSci = NULL;
+	sci_set_clock(dev, VS1053_SCI_SLOW);
 	delay(20);
 
-	dev->dreq_pin = GPIO_DREQ;
-	dev->cs_pin = GPIO_CS;
-	dev->dcs_pin = GPIO_DCS;
-	dev->reset_pin = GPIO_RESET;
-	dev->SPIHandleLow = lvsspi;
+	// SDI bursts are copied into their own DMA-capable buffer before queuing,
+	// so the caller's buffer can be reused while the burst is on the bus.
+	memset(dev->sdiTrans, 0, sizeof(dev->sdiTrans));
+	dev->sdiBuffer = heap_caps_malloc(VS1053_SDI_QUEUE_SIZE * VS1053_CHUNK_SIZE, MALLOC_CAP_DMA);
+	assert(dev->sdiBuffer != NULL);
+	dev->sdiHead = 0;
+	dev->sdiInFlight = 0;
+	dev->sdiBytes = 0;
+	dev->sdiTotalBytes = 0;
+	dev->sdiBusyUs = 0;
+	dev->sdiStatsStart = esp_timer_get_time();
+	dev->cancelState = VS1053_CANCEL_IDLE;
+	dev->streamBytes = 0;
+	dev->trackFormat = VS1053_FORMAT_NONE;
+	dev->trackPending = false;
+	dev->trackFillBytes = 0;
+	dev->trackEnded = false;
+	dev->bass = 0;
+	dev->dreqTimeouts = 0;
+	dev->healthBytes = 0;
+	dev->healthTimeouts = 0;
+	dev->healthDecodeTime = 0;
+	dev->recoverAction = VS1053_RECOVER_NONE;
+	dev->recoveries = 0;
+	dev->recoverUs = 0;
+	dev->sciOwner = NULL;
+	dev->sciNotify = NULL;
+	dev->sciQueueLock = xSemaphoreCreateMutex();
+	assert(dev->sciQueueLock != NULL);
+	dev->sciCount = 0;
+	dev->sciCoalesced = 0;
+
+	// DREQ rising edge wakes the task blocked in await_data_request
+	dev->dreqTask = NULL;
+	dev->dreqWaits = 0;
+	dev->dreqWakeups = 0;
+	dev->dreqWaitUs = 0;
+	dev->dreqTotalWaitUs = 0;
+	dev->dreqRiseUs = 0;
+	memset(dev->dreqJitter, 0, sizeof(dev->dreqJitter));
+	// The interrupt is allocated on the core of the calling task
+	ret = gpio_install_isr_service(0);
+	// Somebody else may have installed the service already
+	assert(ret==ESP_OK || ret==ESP_ERR_INVALID_STATE);
+	ret = gpio_isr_handler_add(GPIO_DREQ, dreq_isr_handler, dev);
+	assert(ret==ESP_OK);
+	gpio_intr_disable(GPIO_DREQ); // Armed only while somebody waits
+#if CONFIG_QUICK_START
+	bool commOk = quick_check(dev);
+#else
 	printDetails(dev, "");
+	ESP_LOGI(TAG, "SCI read %"PRId64" us at %d Hz", sci_access_us(dev), dev->sciFreq);
+	bool commOk = testComm(dev, "Slow SPI,Testing VS1053 read/write registers...\n");
+#endif
+	dev->chipVersion = getHardwareVersion(dev); // CLOCKF layout depends on it
+	phase = boot_phase("slow check", phase);
 
 	// Init SPI in high mode
 	spi_device_handle_t hvsspi;
-	if (testComm(dev, "Slow SPI,Testing VS1053 read/write registers...\n")) {
+	if (commOk) {
 		//softReset();
 		// Switch on the analog parts
 		write_register(dev, SCI_AUDATA, 44101); // 44.1kHz stereo
 		// The next clocksetting allows SPI clocking at 5 MHz, 4 MHz is safe then.
-		write_register(dev, SCI_CLOCKF, 6 << 12); // Normal clock settings multiplyer 3.0 = 12.2 MHz
-		// SPI Clock to 4 MHz. Now you can set high speed SPI clock.
-		//VS1053_SPI = SPISettings(4000000, MSBFIRST, SPI_MODE0);
+		uint16_t clockf = VS1053_CLOCKF; // Normal clock settings multiplyer 3.0 = 12.2 MHz
+		dev->sdiFreq = VS1053_SDI_FREQ;
+		bool stored = clock_profile_load(dev, &clockf, &dev->sdiFreq);
+#if CONFIG_CLOCK_CALIBRATION
+		if (!stored && dev->chipVersion == 4) {
+			clock_calibrate(dev, &clockf, &dev->sdiFreq);
+			clock_profile_save(dev, clockf, dev->sdiFreq);
+			stored = true;
+		}
+#endif
+		ESP_LOGI(TAG, "CLOCKF=0x%04x SDI=%d Hz%s", clockf, dev->sdiFreq, stored ? " (stored profile)" : "");
+		// write_register() moves the SCI device to the fastest clock CLKI allows.
+		write_register(dev, SCI_CLOCKF, clockf);
+#if !CONFIG_QUICK_START
+		ESP_LOGI(TAG, "SCI read %"PRId64" us at %d Hz", sci_access_us(dev), dev->sciFreq);
+#endif
+		phase = boot_phase("clock setup", phase);
 
 		//freq =spi_cal_clock(APB_CLK_FREQ, 6100000, 128, NULL);
 		//ESP_LOGI(TAG,"VS1053 HighFreq: %d",freq);
-		devcfg.clock_speed_hz = 6000000;
-		devcfg.command_bits = 0;
-		devcfg.address_bits = 0;
-		ret = spi_bus_add_device( HSPI_HOST, &devcfg, &hvsspi);
+		spi_device_interface_config_t devcfg={
+			.clock_speed_hz = dev->sdiFreq,
+			.command_bits = 0,
+			.address_bits = 0,
+			.dummy_bits = 0,
+			.duty_cycle_pos = 0,
+			.cs_ena_pretrans = 0,
+			.cs_ena_posttrans = 1,
+			.flags = SPI_DEVICE_NO_DUMMY,
+			.mode = 0,
+			.spics_io_num = -1,
+			.queue_size = VS1053_SDI_QUEUE_SIZE
+		};
+#if CONFIG_CS_HARDWARE
+		// The SDI device owns XDCS
+		devcfg.cs_ena_pretrans = 1;
+		devcfg.spics_io_num = GPIO_DCS;
+#endif
+		ret = spi_bus_add_device( dev->host, &devcfg, &hvsspi);
 		ESP_LOGD(TAG, "spi_bus_add_device=%d",ret);
 		assert(ret==ESP_OK);
 		write_register(dev, SCI_MODE, _BV(SM_SDINEW) | _BV(SM_LINE1));
-		testComm(dev, "Fast SPI, Testing VS1053 read/write registers again...Takes a little time\n");
+#if CONFIG_QUICK_START
+		commOk = quick_check(dev);
+#else
+		commOk = testComm(dev, "Fast SPI, Testing VS1053 read/write registers again...Takes a little time\n");
+#endif
+		if (!commOk && stored) {
+			ESP_LOGW(TAG, "Stored clock profile is not stable, it will be recalibrated on next boot");
+			clock_profile_erase(dev);
+		}
 		ESP_LOGI(TAG, "testComm end");
+		phase = boot_phase("fast check", phase);
 		delay(10);
 		await_data_request(dev);
 		dev->endFillByte = wram_read(dev, 0x1E06) & 0xFF;
 		ESP_LOGI(TAG, "endFillByte=%x", dev->endFillByte);
-		printDetails(dev, "After last clock setting") ;
 		dev->chipVersion = getHardwareVersion(dev);
 		ESP_LOGI(TAG, "chipVersion=%x", dev->chipVersion);
+#if CONFIG_QUICK_START
+		// Register dump and SCI latency are printed once playback runs
+		// It deletes itself, so it isn't created with the tasks of main.c.
+		// Off the feeder core, like the network tasks.
+#if CONFIG_TASK_PINNED
+		xTaskCreatePinnedToCore(&diag_task, "VS1053_DIAG", 1024*3, dev, 1, NULL, CONFIG_NETWORK_CORE);
+#else
+		xTaskCreatePinnedToCore(&diag_task, "VS1053_DIAG", 1024*3, dev, 1, NULL, tskNO_AFFINITY);
+#endif
+#else
+		printDetails(dev, "After last clock setting") ;
 		delay(100);
+#endif
+		phase = boot_phase("finish", phase);
 	}
 
 	dev->SPIHandleFast = hvsspi;
@@ -190,9 +583,49 @@ void spi_master_init(VS1053_t * dev, int16_t GPIO_CS, int16_t GPIO_DCS, int16_t
 
 void await_data_request(VS1053_t * dev)
 {
-	while (!gpio_get_level(dev->dreq_pin)) {
-		taskYIELD();						// Very short delay
+	await_data_request_timeout(dev, portMAX_DELAY);
+}
+
+// Block until DREQ is HIGH or xTicksToWait has passed.
+// Returns false on timeout.
+bool await_data_request_timeout(VS1053_t * dev, TickType_t xTicksToWait)
+{
+	if (gpio_get_level(dev->dreq_pin)) return true;
+
+	int64_t start = esp_timer_get_time();
+	TickType_t startTick = xTaskGetTickCount();
+	bool ready = false;
+
+	xSemaphoreTakeRecursive(dev->lock, portMAX_DELAY); // One waiter at a time
+	dev->dreqWaits++;
+	dev->dreqTask = xTaskGetCurrentTaskHandle();
+	ulTaskNotifyTake(pdTRUE, 0); // Discard a stale wakeup
+	gpio_intr_enable(dev->dreq_pin);
+	while (1) {
+		// DREQ may have risen before the interrupt was armed
+		if (gpio_get_level(dev->dreq_pin)) {
+			ready = true;
+			break;
+		}
+		TickType_t xTicksRemain = portMAX_DELAY;
+		if (xTicksToWait != portMAX_DELAY) {
+			TickType_t elapsed = xTaskGetTickCount() - startTick;
+			if (elapsed >= xTicksToWait) break;
+			xTicksRemain = xTicksToWait - elapsed;
+		}
+		if (ulTaskNotifyTake(pdTRUE, xTicksRemain) == 0) {
+			ready = gpio_get_level(dev->dreq_pin);
+			break;
+		}
+		dev->dreqWakeups++;
 	}
+	gpio_intr_disable(dev->dreq_pin);
+	dev->dreqTask = NULL;
+	int64_t waitUs = esp_timer_get_time() - start;
+	dev->dreqWaitUs += waitUs;
+	dev->dreqTotalWaitUs += waitUs;
+	xSemaphoreGiveRecursive(dev->lock);
+	return ready;
 }
 
 bool current_data_request(VS1053_t * dev)
@@ -200,45 +633,66 @@ bool current_data_request(VS1053_t * dev)
 	return (gpio_get_level(dev->dreq_pin) == HIGH);
 }
 
+// With CONFIG_CS_HARDWARE the SPI driver asserts XCS/XDCS for each transaction.
 void control_mode_on(VS1053_t * dev)
 {
+#if CONFIG_CS_SOFTWARE
 	gpio_set_level(dev->dcs_pin, HIGH);		   // Bring slave in control mode
 	gpio_set_level(dev->cs_pin, LOW);
+#endif
 }
 
 void control_mode_off(VS1053_t * dev) {
+#if CONFIG_CS_SOFTWARE
 	gpio_set_level(dev->cs_pin, HIGH);		   // End control mode
+#endif
 }
 
 void data_mode_on(VS1053_t * dev)
 {
+#if CONFIG_CS_SOFTWARE
 	gpio_set_level(dev->cs_pin, HIGH);		   // Bring slave in data mode
 	gpio_set_level(dev->dcs_pin, LOW);
+#endif
 }
 
 void data_mode_off(VS1053_t * dev)
 {
+#if CONFIG_CS_SOFTWARE
 	gpio_set_level(dev->dcs_pin, HIGH);		   // End data mode
+#endif
 }
 
 
+// SCI accesses wait for DREQ, but not for ever. A decoder that stopped taking
+// data holds DREQ low with a full FIFO, and it still has to be reset.
+static bool sci_await(VS1053_t * dev)
+{
+	if (await_data_request_timeout(dev, pdMS_TO_TICKS(VS1053_DREQ_TIMEOUT_MS))) return true;
+	dev->dreqTimeouts++;
+	return false;
+}
+
 uint16_t read_register(VS1053_t * dev, uint8_t _reg)
 {
 	spi_transaction_t SPITransaction;
 	esp_err_t ret;
 
+	xSemaphoreTakeRecursive(dev->lock, portMAX_DELAY);
+	sdi_wait_idle(dev); // The last SDI burst may still be on the bus
+	sci_await(dev); // Wait for DREQ to be HIGH
 	control_mode_on(dev);
-	await_data_request(dev); // Wait for DREQ to be HIGH
 	memset( &SPITransaction, 0, sizeof( spi_transaction_t ) );
 	SPITransaction.length=16;
 	SPITransaction.flags |= SPI_TRANS_USE_RXDATA	;
 	SPITransaction.cmd = VS_READ_COMMAND;
 	SPITransaction.addr = _reg;
-	ret = spi_device_transmit( dev->SPIHandleLow, &SPITransaction );
+	ret = spi_device_transmit( dev->SPIHandleSci, &SPITransaction );
 	assert(ret==ESP_OK);
 	uint16_t result = (((SPITransaction.rx_data[0]&0xFF)<<8) | ((SPITransaction.rx_data[1])&0xFF)) ;
-	await_data_request(dev); // Wait for DREQ to be HIGH again
 	control_mode_off(dev);
+	sci_await(dev); // Wait for DREQ to be HIGH again
+	xSemaphoreGiveRecursive(dev->lock);
 	return result;
 }
 
@@ -247,8 +701,10 @@ bool write_register(VS1053_t * dev, uint8_t _reg, uint16_t _value)
 	spi_transaction_t SPITransaction;
 	esp_err_t ret;
 
+	xSemaphoreTakeRecursive(dev->lock, portMAX_DELAY);
+	sdi_wait_idle(dev); // The last SDI burst may still be on the bus
+	sci_await(dev); // Wait for DREQ to be HIGH
 	control_mode_on(dev);
-	await_data_request(dev); // Wait for DREQ to be HIGH
 	memset( &SPITransaction, 0, sizeof( spi_transaction_t ) );
 	SPITransaction.flags |= SPI_TRANS_USE_TXDATA;
 	SPITransaction.cmd = VS_WRITE_COMMAND;
@@ -256,69 +712,119 @@ bool write_register(VS1053_t * dev, uint8_t _reg, uint16_t _value)
 	SPITransaction.tx_data[0] = (_value >> 8) & 0xFF;
 	SPITransaction.tx_data[1] = (_value & 0xFF);
 	SPITransaction.length= 16;
-	ret = spi_device_transmit( dev->SPIHandleLow, &SPITransaction );
+	ret = spi_device_transmit( dev->SPIHandleSci, &SPITransaction );
 	assert(ret==ESP_OK);
-	await_data_request(dev); // Wait for DREQ to be HIGH again
 	control_mode_off(dev);
+	sci_await(dev); // Wait for DREQ to be HIGH again
+	if (_reg == SCI_CLOCKF) {
+		// Pick the SCI clock for the new CLKI
+		dev->clockf = _value;
+		sci_set_clock(dev, (_value & 0xE000) ? sci_max_clock(dev, _value) : VS1053_SCI_SLOW);
+	}
+	xSemaphoreGiveRecursive(dev->lock);
 	return true;
 }
 
-bool sdi_send_buffer(VS1053_t * dev, uint8_t* data, size_t len)
+// Wait until all queued SDI transactions have left the bus
+void sdi_wait_idle(VS1053_t * dev)
 {
-	size_t chunk_length; // Length of chunk 32 byte or shorter
-	spi_transaction_t SPITransaction;
+	spi_transaction_t *rtrans;
 	esp_err_t ret;
 
-	data_mode_on(dev);
-	while (len) // More to do?
-	{
-		await_data_request(dev); // Wait for space available
-		chunk_length = len;
-		if (len > VS1053_CHUNK_SIZE) {
-			chunk_length = VS1053_CHUNK_SIZE;
-		}
-		len -= chunk_length;
-	   
-	   
-		memset( &SPITransaction, 0, sizeof( spi_transaction_t ) );
-		SPITransaction.length = chunk_length * 8;
-		SPITransaction.tx_buffer = data;
-		ret = spi_device_transmit( dev->SPIHandleFast, &SPITransaction );
+	while (dev->sdiInFlight) {
+		ret = spi_device_get_trans_result( dev->SPIHandleFast, &rtrans, portMAX_DELAY );
 		assert(ret==ESP_OK);
-		data += chunk_length;
+		dev->sdiInFlight--;
+	}
+}
+
+// Queue one burst of up to VS1053_CHUNK_SIZE bytes.
+// When data is NULL, the burst is filled with endFillByte.
+// Returns false if the decoder didn't take it.
+static bool sdi_queue_burst(VS1053_t * dev, const uint8_t *data, size_t len)
+{
+	spi_transaction_t *trans = &dev->sdiTrans[dev->sdiHead];
+	uint8_t *burst = &dev->sdiBuffer[dev->sdiHead * VS1053_CHUNK_SIZE];
+	esp_err_t ret;
+
+	// The slot is free: at most one transaction is in flight and it uses the other slot.
+	// Prepare the next burst while the previous one is still being clocked out.
+	if (data) {
+		memcpy(burst, data, len);
+	} else {
+		memset(burst, dev->endFillByte, len);
+	}
+
+	// DREQ only vouches for 32 free bytes once everything sent before has arrived.
+	sdi_wait_idle(dev);
+	dev->dreqRiseUs = 0;
+	if (!await_data_request_timeout(dev, pdMS_TO_TICKS(VS1053_DREQ_TIMEOUT_MS))) {
+		// Drop the burst, checkHealth() notices
+		dev->dreqTimeouts++;
+		return false;
 	}
+
+	data_mode_on(dev);
+	trans->length = len * 8;
+	trans->tx_buffer = burst;
+	ret = spi_device_queue_trans( dev->SPIHandleFast, trans, portMAX_DELAY );
+	assert(ret==ESP_OK);
+	dev->sdiInFlight++;
+	if (dev->dreqRiseUs) {
+		// Woken by DREQ rising
+		int64_t jitter = esp_timer_get_time() - dev->dreqRiseUs;
+		int bucket = 0;
+		while (bucket < VS1053_JITTER_BUCKETS - 1 && jitter >= (8 << bucket)) bucket++;
+		dev->dreqJitter[bucket]++;
+	}
+#if CONFIG_CS_SOFTWARE
+	sdi_wait_idle(dev); // XDCS must stay low until the burst is out
+#endif
+	// With hardware CS the burst is left in flight and reaped before the next DREQ check
 	data_mode_off(dev);
+	dev->sdiHead = (dev->sdiHead + 1) % VS1053_SDI_QUEUE_SIZE;
+	dev->sdiBytes += len;
+	dev->sdiTotalBytes += len;
 	return true;
 }
 
-bool sdi_send_fillers(VS1053_t * dev, size_t len)
+// Returns false if a burst was dropped after a DREQ timeout.
+// The rest of the data is dropped with it.
+static bool sdi_send(VS1053_t * dev, const uint8_t *data, size_t len)
 {
 	size_t chunk_length; // Length of chunk 32 byte or shorter
-	spi_transaction_t SPITransaction;
-	esp_err_t ret;
-	uint8_t data[VS1053_CHUNK_SIZE];
-	for(int i=0;i<VS1053_CHUNK_SIZE;i++) data[i] = dev->endFillByte;
-	
-	data_mode_on(dev);
+	int64_t start = esp_timer_get_time();
+	bool sent = true;
+
+	xSemaphoreTakeRecursive(dev->lock, portMAX_DELAY);
 	while (len) // More to do?
 	{
-		await_data_request(dev); // Wait for space available
 		chunk_length = len;
 		if (len > VS1053_CHUNK_SIZE) {
 			chunk_length = VS1053_CHUNK_SIZE;
 		}
 		len -= chunk_length;
-	   
-	   
-		memset( &SPITransaction, 0, sizeof( spi_transaction_t ) );
-		SPITransaction.length = chunk_length * 8;
-		SPITransaction.tx_buffer = data;
-		ret = spi_device_transmit( dev->SPIHandleFast, &SPITransaction );
-		assert(ret==ESP_OK);
+		if (!sdi_queue_burst(dev, data, chunk_length)) {
+			sent = false;
+			break;
+		}
+		if (data) data += chunk_length;
+		// Slot one queued SCI command in after each burst
+		if (dev->sciCount && dev->sciOwner == xTaskGetCurrentTaskHandle()) sciService(dev, 1);
 	}
-	data_mode_off(dev);
-	return true;
+	dev->sdiBusyUs += esp_timer_get_time() - start;
+	xSemaphoreGiveRecursive(dev->lock);
+	return sent;
+}
+
+bool sdi_send_buffer(VS1053_t * dev, uint8_t* data, size_t len)
+{
+	return sdi_send(dev, data, len);
+}
 
+bool sdi_send_fillers(VS1053_t * dev, size_t len)
+{
+	return sdi_send(dev, NULL, len);
 }
 
 
@@ -334,6 +840,114 @@ uint16_t wram_read(VS1053_t * dev, uint16_t address) {
 	return read_register(dev, SCI_WRAM);		// Read back result
 }
 
+// Write n words to one SCI register in a single XCS window (SCI multiple write).
+// When values is NULL, fill is written n times.
+// DREQ is low only while the previous word executes, so it is checked between words.
+bool sci_write_multiple(VS1053_t * dev, uint8_t _reg, const uint16_t *values, uint16_t fill, size_t n)
+{
+	spi_transaction_ext_t SPITransaction;
+	esp_err_t ret;
+
+	if (n == 0) return true;
+	xSemaphoreTakeRecursive(dev->lock, portMAX_DELAY);
+	sdi_wait_idle(dev); // The last SDI burst may still be on the bus
+	if (!sci_await(dev)) { // Wait for DREQ to be HIGH
+		xSemaphoreGiveRecursive(dev->lock);
+		return false;
+	}
+	bool ok = true;
+#if CONFIG_CS_HARDWARE
+	// XCS stays low between transactions, nobody else may use the bus meanwhile
+	ret = spi_device_acquire_bus(dev->SPIHandleSci, portMAX_DELAY);
+	assert(ret==ESP_OK);
+#endif
+	control_mode_on(dev);
+	for (size_t i = 0; i < n; i++) {
+		// Previous word is executing
+		if (i > 0 && !sci_await(dev)) {
+			ok = false;
+			break;
+		}
+		uint16_t _value = values ? values[i] : fill;
+		memset( &SPITransaction, 0, sizeof( spi_transaction_ext_t ) );
+		SPITransaction.base.flags = SPI_TRANS_USE_TXDATA;
+		if (i == 0) {
+			SPITransaction.base.cmd = VS_WRITE_COMMAND;
+			SPITransaction.base.addr = _reg;
+		} else {
+			// Following words are sent without command and address
+			SPITransaction.base.flags |= SPI_TRANS_VARIABLE_CMD | SPI_TRANS_VARIABLE_ADDR;
+			SPITransaction.command_bits = 0;
+			SPITransaction.address_bits = 0;
+		}
+#if CONFIG_CS_HARDWARE
+		if (i < n - 1) SPITransaction.base.flags |= SPI_TRANS_CS_KEEP_ACTIVE;
+#endif
+		SPITransaction.base.tx_data[0] = (_value >> 8) & 0xFF;
+		SPITransaction.base.tx_data[1] = (_value & 0xFF);
+		SPITransaction.base.length = 16;
+		ret = spi_device_polling_transmit( dev->SPIHandleSci, &SPITransaction.base );
+		assert(ret==ESP_OK);
+	}
+#if CONFIG_CS_HARDWARE
+	if (!ok) {
+		// The last word kept XCS low. An empty transaction raises it without clocking the chip.
+		memset( &SPITransaction, 0, sizeof( spi_transaction_ext_t ) );
+		SPITransaction.base.flags = SPI_TRANS_VARIABLE_CMD | SPI_TRANS_VARIABLE_ADDR;
+		SPITransaction.command_bits = 0;
+		SPITransaction.address_bits = 0;
+		SPITransaction.base.length = 0;
+		ret = spi_device_polling_transmit( dev->SPIHandleSci, &SPITransaction.base );
+		assert(ret==ESP_OK);
+	}
+#endif
+	control_mode_off(dev); // With CONFIG_CS_SOFTWARE this raises XCS, also after a timeout
+#if CONFIG_CS_HARDWARE
+	spi_device_release_bus(dev->SPIHandleSci);
+#endif
+	if (ok) ok = sci_await(dev); // Wait for DREQ to be HIGH again
+	xSemaphoreGiveRecursive(dev->lock);
+	if (!ok) ESP_LOGW(TAG, "SCI multiple write of %d words to 0x%02x timed out", n, _reg);
+	return ok;
+}
+
+bool wram_write_block(VS1053_t * dev, uint16_t address, const uint16_t *data, size_t n) {
+	write_register(dev, SCI_WRAMADDR, address);
+	return sci_write_multiple(dev, SCI_WRAM, data, 0, n);
+}
+
+// SCI has no multiple read, but the lock, the SDI drain and the address
+// setup are done once for the whole block.
+// Returns false when DREQ didn't come back, data is then incomplete.
+bool wram_read_block(VS1053_t * dev, uint16_t address, uint16_t *data, size_t n) {
+	spi_transaction_t SPITransaction;
+	esp_err_t ret;
+	bool ok = true;
+
+	xSemaphoreTakeRecursive(dev->lock, portMAX_DELAY);
+	write_register(dev, SCI_WRAMADDR, address); // Start reading from WRAM
+	for (size_t i = 0; i < n; i++) {
+		if (!sci_await(dev)) { // Wait for DREQ to be HIGH
+			ok = false;
+			break;
+		}
+		control_mode_on(dev);
+		memset( &SPITransaction, 0, sizeof( spi_transaction_t ) );
+		SPITransaction.length=16;
+		SPITransaction.flags |= SPI_TRANS_USE_RXDATA;
+		SPITransaction.cmd = VS_READ_COMMAND;
+		SPITransaction.addr = SCI_WRAM;
+		ret = spi_device_polling_transmit( dev->SPIHandleSci, &SPITransaction );
+		assert(ret==ESP_OK);
+		control_mode_off(dev);
+		data[i] = (((SPITransaction.rx_data[0]&0xFF)<<8) | ((SPITransaction.rx_data[1])&0xFF));
+	}
+	if (ok) ok = sci_await(dev);
+	xSemaphoreGiveRecursive(dev->lock);
+	if (!ok) ESP_LOGW(TAG, "WRAM read of %d words at 0x%04x timed out", n, address);
+	return ok;
+}
+
 bool testComm(VS1053_t * dev, char *header) {
 	// Test the communication with the VS1053 module.  The result wille be returned.
 	// If DREQ is low, there is problably no VS1053 connected.	Pull the line HIGH
@@ -429,7 +1043,7 @@ void setVolume(VS1053_t * dev, uint8_t vol) {
 	dev->curvol = vol;						  // Save for later use
 	value = map(vol, 0, 100, 0xFF, 0x00); // 0..100% to one channel
 	value = (value << 8) | value;
-	write_register(dev, SCI_VOL, value); // Volume left and right
+	sciQueueWrite(dev, SCI_VOL, value, VS1053_PRIO_CONTROL); // Volume left and right
 }
 
 void setTone(VS1053_t * dev, uint8_t *rtone) { // Set bass/treble (4 nibbles)
@@ -440,7 +1054,8 @@ void setTone(VS1053_t * dev, uint8_t *rtone) { // Set bass/treble (4 nibbles)
 	for (i = 0; i < 4; i++) {
 		value = (value << 4) | rtone[i]; // Shift next nibble in
 	}
-	write_register(dev, SCI_BASS, value); // Volume left and right
+	dev->bass = value;
+	sciQueueWrite(dev, SCI_BASS, value, VS1053_PRIO_CONTROL); // Volume left and right
 }
 
 uint8_t getVolume(VS1053_t * dev) { // Get the currenet volume setting.
@@ -452,34 +1067,165 @@ void startSong(VS1053_t * dev) {
 }
 
 void playChunk(VS1053_t * dev, uint8_t *data, size_t len) {
-	sdi_send_buffer(dev, data, len);
+	// A pending stopSongAsync() must finish before the next stream starts
+	while (stopSongStep(dev)) {
+		if (!await_data_request_timeout(dev, pdMS_TO_TICKS(VS1053_DREQ_TIMEOUT_MS))) {
+			dev->dreqTimeouts++;
+			return;
+		}
+	}
+	if (len) dev->trackEnded = false; // Even if a burst is dropped, the decoder may have some of it
+	if (sdi_send_buffer(dev, data, len)) dev->streamBytes += len;
 }
 
-void stopSong(VS1053_t * dev) {
-	uint16_t modereg; // Read from mode register
-	int i;			  // Loop control
+/**
+ * Mark the start of the next track in a playlist. Call this before the
+ * first playChunk() of the track.
+ *
+ * Same-format MP3 or ADTS tracks are sent back to back, nothing is inserted.
+ * Other formats first end the previous track with stopSongAsync(), which
+ * playChunk() completes before sending the new data.
+ *
+ * A stop that is already running (e.g. after a station switch) must end
+ * first, so false is returned and nothing is marked. Call playChunk() with
+ * no data to complete it, then call this again. That stop has ended the
+ * previous track, so no second one is needed.
+ */
+bool startTrack(VS1053_t * dev, uint8_t format) {
+	if (dev->cancelState != VS1053_CANCEL_IDLE) return false;
+	if (dev->trackEnded || dev->trackFormat == VS1053_FORMAT_NONE) {
+		// Nothing to end. trackFillBytes are those of the stop that ended the last track.
+	} else if (frameConcatenable(dev->trackFormat, format)) {
+		dev->trackFillBytes = 0;
+	} else {
+		stopSongAsync(dev, NULL, NULL);
+	}
+	dev->trackFormat = format;
+	dev->trackBoundary = dev->streamBytes;
+	dev->trackPending = true;
+	return true;
+}
 
-	sdi_send_fillers(dev, 2052);
-	delay(10);
-	write_register(dev, SCI_MODE, _BV(SM_SDINEW) | _BV(SM_CANCEL));
-	for (i = 0; i < 200; i++) {
-		sdi_send_fillers(dev, 32);
-		modereg = read_register(dev, SCI_MODE); // Read status
+/**
+ * Follow the decoder across the last track boundary.
+ *
+ * After a format change the boundary is reached when SCI_HDAT1 reports the
+ * new format. For back to back tracks it is reached once the FIFO has been
+ * refilled with the new track. SCI_DECODE_TIME is then cleared, so
+ * getDecodedTime() counts the new track.
+ *
+ * @return true once per boundary
+ */
+bool trackChanged(VS1053_t * dev) {
+	if (!dev->trackPending) return false;
+	if (dev->cancelState != VS1053_CANCEL_IDLE) return false;
+	if (dev->trackFillBytes) { // Format change
+		if (getDecodedFormat(dev) != dev->trackFormat) return false;
+	} else {
+		if (dev->streamBytes - dev->trackBoundary < VS1053_FIFO_SIZE) return false;
+	}
+	clearDecodedTime(dev);
+	dev->trackPending = false;
+	ESP_LOGI(TAG, "Track boundary reached, %"PRIu32" fill bytes inserted", dev->trackFillBytes);
+	return true;
+}
+
+// Reset the chip and restore what softReset() clears: the mode, the volume and the tone.
+// softReset() restores the clock itself.
+static void recover_reset(VS1053_t * dev) {
+	dev->cancelState = VS1053_CANCEL_IDLE;
+	dev->trackEnded = true;
+	softReset(dev);
+	write_register(dev, SCI_MODE, _BV(SM_SDINEW) | _BV(SM_LINE1));
+	setVolume(dev, dev->curvol);
+	write_register(dev, SCI_BASS, dev->bass);
+}
+
+static void stop_song_finish(VS1053_t * dev, bool ok) {
+	int64_t elapsed = (esp_timer_get_time() - dev->cancelStart) / 1000;
+	dev->cancelState = VS1053_CANCEL_IDLE;
+	dev->trackEnded = true;
+	if (ok) {
+		ESP_LOGI(TAG, "Song stopped correctly after %"PRId64" msec", elapsed);
+	} else {
+		ESP_LOGW(TAG, "Song stopped incorrectly after %"PRId64" msec", elapsed);
+		recover_reset(dev);
+	}
+	if (dev->cancelCallback) dev->cancelCallback(dev->cancelArg, ok);
+}
+
+/**
+ * Start finishing the current song without blocking.
+ *
+ * @see VS1053b Datasheet (1.31) / 10.5.1 Playing a Whole File
+ *
+ * 2052 endFillBytes are sent, then SM_CANCEL is set and SM_CANCEL is checked
+ * after every 32 further endFillBytes. The next stream may start as soon as
+ * SM_CANCEL clears. If it hasn't cleared after 2048 bytes, the chip is reset.
+ * The work is done by stopSongStep(); playChunk() completes it before new data.
+ * callback (may be NULL) is called with the result when the song has stopped.
+ */
+void stopSongAsync(VS1053_t * dev, void (*callback)(void *arg, bool ok), void *arg) {
+	dev->cancelState = VS1053_CANCEL_FLUSH;
+	dev->cancelCount = 2052;
+	dev->trackFillBytes = 0; // Counted by stopSongStep()
+	dev->cancelCallback = callback;
+	dev->cancelArg = arg;
+	dev->cancelStart = esp_timer_get_time();
+}
+
+// Advance stopSongAsync() by one burst if DREQ allows it.
+// Returns true while the song is still stopping.
+bool stopSongStep(VS1053_t * dev) {
+	if (dev->cancelState == VS1053_CANCEL_IDLE) return false;
+	if (!current_data_request(dev)) return true; // Don't block the caller
+
+	size_t chunk_length = dev->cancelCount;
+	if (chunk_length > VS1053_CHUNK_SIZE) {
+		chunk_length = VS1053_CHUNK_SIZE;
+	}
+	if (!sdi_send_fillers(dev, chunk_length)) return true; // Try again on the next step
+	dev->cancelCount -= chunk_length;
+	dev->trackFillBytes += chunk_length;
+
+	if (dev->cancelState == VS1053_CANCEL_FLUSH) {
+		if (dev->cancelCount == 0) {
+			uint16_t modereg = read_register(dev, SCI_MODE);
+			write_register(dev, SCI_MODE, modereg | _BV(SM_CANCEL));
+			dev->cancelState = VS1053_CANCEL_WAIT;
+			dev->cancelCount = 2048;
+		}
+	} else {
+		uint16_t modereg = read_register(dev, SCI_MODE); // Read status
 		if ((modereg & _BV(SM_CANCEL)) == 0) {
-			sdi_send_fillers(dev, 2052);
-			ESP_LOGI(TAG, "Song stopped correctly after %d msec", i * 10);
-			return;
+			stop_song_finish(dev, true);
+		} else if (dev->cancelCount == 0) {
+			stop_song_finish(dev, false);
+		}
+	}
+	return (dev->cancelState != VS1053_CANCEL_IDLE);
+}
+
+// A decoder that stops taking the fill bytes is reset.
+void stopSong(VS1053_t * dev) {
+	stopSongAsync(dev, NULL, NULL);
+	while (stopSongStep(dev)) {
+		if (!sci_await(dev)) {
+			ESP_LOGW(TAG, "DREQ stayed low while stopping the song");
+			recover_reset(dev);
+			break;
 		}
-		delay(10);
 	}
-	printDetails(dev, "Song stopped incorrectly!");
 }
 
 void softReset(VS1053_t * dev) {
 	ESP_LOGI(TAG, "Performing soft-reset");
 	write_register(dev, SCI_MODE, _BV(SM_SDINEW) | _BV(SM_RESET));
+	// Talk slowly until the clock setting is restored
+	sci_set_clock(dev, VS1053_SCI_SLOW);
 	delay(10);
-	await_data_request(dev);
+	sci_await(dev);
+	if (dev->clockf) write_register(dev, SCI_CLOCKF, dev->clockf);
 }
 
 void printDetails(VS1053_t * dev, char *header) {
@@ -491,7 +1237,7 @@ void printDetails(VS1053_t * dev, char *header) {
 	ESP_LOGI(TAG, "---	 -----");
 	for (int i = 0; i <= SCI_num_registers; i++) {
 		//regbuf[i] = read_register(dev, i);
-		uint16_t regbuf = read_register(dev, i);
+		uint16_t regbuf = sci_read_status(dev, i);
 		delay(5);
 		//ESP_LOGI(TAG, "%3X - %5X", i, regbuf[i]);
 		ESP_LOGI(TAG, "%3X - %5X", i, regbuf);
@@ -529,7 +1275,7 @@ void switchToMp3Mode(VS1053_t * dev) {
  * @return true if the chip is wired up correctly
  */
 bool isChipConnected(VS1053_t * dev) {
-	uint16_t status = read_register(dev, SCI_STATUS);
+	uint16_t status = sci_read_status(dev, SCI_STATUS);
 
 	return !(status == 0 || status == 0xFFFF);
 }
@@ -555,7 +1301,7 @@ bool isChipConnected(VS1053_t * dev) {
  * @return current decoded time in full seconds
  */
 uint16_t getDecodedTime(VS1053_t * dev) {
-	return read_register(dev, SCI_DECODE_TIME);
+	return sci_read_status(dev, SCI_DECODE_TIME);
 }
 
 /**
@@ -571,8 +1317,318 @@ void clearDecodedTime(VS1053_t * dev) {
 	write_register(dev, SCI_DECODE_TIME, 0x00);
 } 
 
+/**
+ * Load a VLSI plugin or patch in the compressed format of the .plg files
+ * (e.g. the VS1053b patches package, FLAC or spectrum analyzer plugins).
+ *
+ * The table is a sequence of records: register address, count, values.
+ * If bit 15 of the count is set, the single value that follows is repeated
+ * (count & 0x7FFF) times, otherwise count values follow.
+ * Runs are streamed with SCI multiple writes.
+ *
+ * @return false if the table is truncated, or DREQ didn't come back
+ */
+bool loadUserCode(VS1053_t * dev, const uint16_t *plugin, size_t len) {
+	int64_t start = esp_timer_get_time();
+	size_t words = 0;
+	size_t i = 0;
+
+	while (i + 2 <= len) {
+		uint8_t addr = plugin[i++];
+		uint16_t n = plugin[i++];
+		if (n & 0x8000U) { // RLE run, replicate n samples
+			n &= 0x7FFF;
+			if (i + 1 > len) break;
+			uint16_t val = plugin[i++];
+			if (n == 1) {
+				write_register(dev, addr, val);
+			} else if (!sci_write_multiple(dev, addr, NULL, val, n)) {
+				return false;
+			}
+		} else { // Copy run, copy n samples
+			if (i + n > len) break;
+			if (n == 1) {
+				write_register(dev, addr, plugin[i]);
+			} else if (!sci_write_multiple(dev, addr, &plugin[i], 0, n)) {
+				return false;
+			}
+			i += n;
+		}
+		words += n;
+	}
+	ESP_LOGI(TAG, "loadUserCode %d words in %"PRId64" ms", words, (esp_timer_get_time() - start) / 1000);
+	if (i != len) {
+		ESP_LOGW(TAG, "loadUserCode truncated table at %d/%d", i, len);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Provides the format being decoded, from SCI_HDAT1
+ *
+ * @see VS1053b Datasheet (1.31) / 9.6.9 SCI_HDAT0 and SCI_HDAT1 (R)
+ *
+ * @return VS1053_FORMAT_xxx
+ */
+uint8_t getDecodedFormat(VS1053_t * dev) {
+	uint16_t hdat1 = sci_read_status(dev, SCI_HDAT1);
+
+	if (hdat1 >= 0xFFE0) return VS1053_FORMAT_MP3; // Frame sync
+	switch (hdat1) {
+	case 0x7665: return VS1053_FORMAT_WAV;  // "ve"
+	case 0x4154: return VS1053_FORMAT_AAC;  // "AT"
+	case 0x4144: return VS1053_FORMAT_ADIF; // "AD"
+	case 0x4D34: return VS1053_FORMAT_M4A;  // "M4"
+	case 0x574D: return VS1053_FORMAT_WMA;  // "WM"
+	case 0x4F67: return VS1053_FORMAT_OGG;  // "Og"
+	case 0x664C: return VS1053_FORMAT_FLAC; // "fL"
+	case 0x4D54: return VS1053_FORMAT_MIDI; // "MT"
+	}
+	return VS1053_FORMAT_NONE;
+}
+
 uint8_t getHardwareVersion(VS1053_t * dev) {
-	uint16_t status = read_register(dev, SCI_STATUS);
+	uint16_t status = sci_read_status(dev, SCI_STATUS);
 
 	return (status>>4)&0xf;
 }
+
+void printSdiStats(VS1053_t * dev) {
+	int64_t now = esp_timer_get_time();
+	int64_t elapsed = now - dev->sdiStatsStart;
+	if (elapsed <= 0) return;
+
+	uint32_t bytesPerSec = (uint64_t)dev->sdiBytes * 1000000 / elapsed;
+	uint32_t usPerKB = 0;
+	if (dev->sdiBytes) usPerKB = dev->sdiBusyUs * 1024 / dev->sdiBytes;
+	ESP_LOGI(TAG, "SDI %"PRIu32" bytes in %"PRId64" ms, %"PRIu32" bytes/s, %"PRIu32" us per KB in the SDI engine",
+		dev->sdiBytes, elapsed / 1000, bytesPerSec, usPerKB);
+	ESP_LOGI(TAG, "DREQ %"PRIu32" waits, %"PRIu32" wakeups, %"PRId64" ms waiting",
+		dev->dreqWaits, dev->dreqWakeups, dev->dreqWaitUs / 1000);
+	char histogram[VS1053_JITTER_BUCKETS * 20]; // " >=512:4294967295" is 17 characters
+	int length = 0;
+	for (int i=0; i<VS1053_JITTER_BUCKETS && length < sizeof(histogram); i++) {
+		length += snprintf(&histogram[length], sizeof(histogram) - length, " %s%d:%"PRIu32,
+			(i == VS1053_JITTER_BUCKETS - 1) ? ">=" : "<", (i == VS1053_JITTER_BUCKETS - 1) ? (8 << (i-1)) : (8 << i),
+			dev->dreqJitter[i]);
+	}
+	ESP_LOGI(TAG, "DREQ to burst us%s", histogram);
+	ESP_LOGI(TAG, "SCI queue %d pending, %"PRIu32" writes coalesced", dev->sciCount, dev->sciCoalesced);
+	memset(dev->dreqJitter, 0, sizeof(dev->dreqJitter));
+	dev->sdiBytes = 0;
+	dev->sdiBusyUs = 0;
+	dev->dreqWaits = 0;
+	dev->dreqWakeups = 0;
+	dev->dreqWaitUs = 0;
+	dev->sdiStatsStart = now;
+}
+
+static const char *recoverName[] = { "none", "flush", "cancel", "reset" };
+
+/**
+ * Check that the decoder makes progress.
+ *
+ * Three SCI reads: SCI_DECODE_TIME must move while data is taken, and
+ * SCI_HDAT0/1 must show a recognized stream. DREQ waits that timed out
+ * mean the decoder stopped taking data. Call this every few seconds while
+ * playing, SCI_DECODE_TIME counts seconds.
+ */
+uint8_t checkHealth(VS1053_t * dev) {
+	uint32_t bytes = dev->streamBytes - dev->healthBytes;
+	uint32_t timeouts = dev->dreqTimeouts - dev->healthTimeouts;
+	dev->healthBytes = dev->streamBytes;
+	dev->healthTimeouts = dev->dreqTimeouts;
+	if (timeouts) return VS1053_HEALTH_BLOCKED;
+
+	uint16_t decodeTime = read_register(dev, SCI_DECODE_TIME);
+	uint16_t hdat1 = read_register(dev, SCI_HDAT1);
+	uint16_t hdat0 = read_register(dev, SCI_HDAT0);
+	bool moved = (decodeTime != dev->healthDecodeTime);
+	dev->healthDecodeTime = decodeTime;
+
+	// Nothing to judge while the stream is changing
+	if (dev->cancelState != VS1053_CANCEL_IDLE || dev->trackPending) return VS1053_HEALTH_OK;
+
+	uint8_t health = VS1053_HEALTH_OK;
+	if (bytes < VS1053_FIFO_SIZE) {
+		health = VS1053_HEALTH_UNDERRUN;
+	} else if (hdat1 == 0 && hdat0 == 0) {
+		health = VS1053_HEALTH_FORMAT;
+	} else if (!moved) {
+		health = VS1053_HEALTH_STALLED;
+	}
+
+	if (health == VS1053_HEALTH_OK && dev->recoverAction != VS1053_RECOVER_NONE) {
+		dev->recoveries++;
+		dev->recoverUs += esp_timer_get_time() - dev->recoverStart;
+		ESP_LOGW(TAG, "Recovered by %s after %"PRId64" ms, mean time to recover %"PRId64" ms over %"PRIu32,
+			recoverName[dev->recoverAction], (esp_timer_get_time() - dev->recoverStart) / 1000,
+			dev->recoverUs / dev->recoveries / 1000, dev->recoveries);
+		dev->recoverAction = VS1053_RECOVER_NONE;
+	}
+	return health;
+}
+
+/**
+ * Recover from a failed checkHealth() with the cheapest action that works.
+ *
+ * A stalled or unrecognized stream is first flushed with endFillBytes, then
+ * ended with SM_CANCEL. When that didn't help, or DREQ stays low, the chip is
+ * reset. The SPI setup of spi_master_init() is kept.
+ */
+uint8_t recoverHealth(VS1053_t * dev, uint8_t health) {
+	if (health == VS1053_HEALTH_OK || health == VS1053_HEALTH_UNDERRUN) return VS1053_RECOVER_NONE;
+	if (dev->recoverAction == VS1053_RECOVER_NONE) dev->recoverStart = esp_timer_get_time();
+
+	uint8_t action = dev->recoverAction + 1;
+	if (health == VS1053_HEALTH_BLOCKED || action > VS1053_RECOVER_RESET) action = VS1053_RECOVER_RESET;
+	ESP_LOGW(TAG, "Decoder %s, %s", (health == VS1053_HEALTH_BLOCKED) ? "blocked" :
+		(health == VS1053_HEALTH_FORMAT) ? "doesn't recognize the stream" : "stalled", recoverName[action]);
+	switch (action) {
+	case VS1053_RECOVER_FLUSH:
+		sdi_send_fillers(dev, VS1053_FIFO_SIZE);
+		break;
+	case VS1053_RECOVER_CANCEL:
+		stopSongAsync(dev, NULL, NULL);
+		break;
+	case VS1053_RECOVER_RESET:
+		recover_reset(dev);
+		break;
+	}
+	dev->recoverAction = action;
+	// Judge the action from here
+	dev->healthBytes = dev->streamBytes;
+	dev->healthTimeouts = dev->dreqTimeouts;
+	return action;
+}
+
+void sciSetOwner(VS1053_t * dev, void (*notify)(void *arg), void *arg) {
+	dev->sciNotify = notify;
+	dev->sciNotifyArg = arg;
+	dev->sciOwner = xTaskGetCurrentTaskHandle();
+}
+
+static bool sci_is_owner(VS1053_t * dev) {
+	return (dev->sciOwner == NULL || dev->sciOwner == xTaskGetCurrentTaskHandle());
+}
+
+/**
+ * Queue a register write for the bus owner.
+ *
+ * A write to a register that is still pending replaces the pending value,
+ * so a burst of volume steps costs one SCI write. Without an owner, or
+ * from the owner itself, the register is written at once.
+ */
+bool sciQueueWrite(VS1053_t * dev, uint8_t reg, uint16_t value, uint8_t priority) {
+	if (sci_is_owner(dev)) return write_register(dev, reg, value);
+
+	bool queued = true;
+	xSemaphoreTake(dev->sciQueueLock, portMAX_DELAY);
+	int i;
+	for (i=0; i<dev->sciCount; i++) {
+		if (dev->sciQueue[i].write && dev->sciQueue[i].reg == reg) break;
+	}
+	if (i < dev->sciCount) {
+		dev->sciQueue[i].value = value;
+		if (priority < dev->sciQueue[i].priority) dev->sciQueue[i].priority = priority;
+		dev->sciCoalesced++;
+	} else if (dev->sciCount < VS1053_SCI_QUEUE_SIZE) {
+		VS1053_SCI_CMD_t *cmd = &dev->sciQueue[dev->sciCount];
+		cmd->reg = reg;
+		cmd->priority = priority;
+		cmd->write = true;
+		cmd->value = value;
+		cmd->result = NULL;
+		cmd->task = NULL;
+		dev->sciCount++;
+	} else {
+		queued = false;
+	}
+	xSemaphoreGive(dev->sciQueueLock);
+	if (!queued) {
+		ESP_LOGW(TAG, "SCI queue full, write to %x dropped", reg);
+		return false;
+	}
+	if (dev->sciNotify) dev->sciNotify(dev->sciNotifyArg);
+	return true;
+}
+
+// The owner notifies the task when value has been read
+bool sciQueueRead(VS1053_t * dev, uint8_t reg, uint16_t *value, uint8_t priority, TickType_t xTicksToWait) {
+	if (sci_is_owner(dev)) {
+		*value = read_register(dev, reg);
+		return true;
+	}
+
+	// A notification left over from something else, e.g. a DREQ interrupt
+	// after a timed out wait, must not pass for this read
+	ulTaskNotifyTake(pdTRUE, 0);
+	xSemaphoreTake(dev->sciQueueLock, portMAX_DELAY);
+	if (dev->sciCount == VS1053_SCI_QUEUE_SIZE) {
+		xSemaphoreGive(dev->sciQueueLock);
+		return false;
+	}
+	VS1053_SCI_CMD_t *cmd = &dev->sciQueue[dev->sciCount];
+	cmd->reg = reg;
+	cmd->priority = priority;
+	cmd->write = false;
+	cmd->result = value;
+	cmd->task = xTaskGetCurrentTaskHandle();
+	dev->sciCount++;
+	xSemaphoreGive(dev->sciQueueLock);
+	if (dev->sciNotify) dev->sciNotify(dev->sciNotifyArg);
+
+	if (ulTaskNotifyTake(pdTRUE, xTicksToWait)) return true;
+
+	// Timed out. Withdraw the read, unless the owner has taken it already.
+	bool withdrawn = false;
+	xSemaphoreTake(dev->sciQueueLock, portMAX_DELAY);
+	for (int i=0; i<dev->sciCount; i++) {
+		if (!dev->sciQueue[i].write && dev->sciQueue[i].result == value) {
+			memmove(&dev->sciQueue[i], &dev->sciQueue[i+1], (dev->sciCount - i - 1) * sizeof(VS1053_SCI_CMD_t));
+			dev->sciCount--;
+			withdrawn = true;
+			break;
+		}
+	}
+	xSemaphoreGive(dev->sciQueueLock);
+	if (withdrawn) return false;
+	ulTaskNotifyTake(pdTRUE, portMAX_DELAY); // The owner is reading it now
+	return true;
+}
+
+/**
+ * Run up to max queued commands, highest priority first, oldest first
+ * within a priority. Only the bus owner calls this: between SDI bursts,
+ * one at a time, and when it has no audio to send.
+ * @return number of commands run
+ */
+int sciService(VS1053_t * dev, int max) {
+	int done = 0;
+	while (done < max) {
+		// A read that timed out may have been withdrawn since sciCount was looked at
+		xSemaphoreTake(dev->sciQueueLock, portMAX_DELAY);
+		if (dev->sciCount == 0) {
+			xSemaphoreGive(dev->sciQueueLock);
+			break;
+		}
+		int next = 0;
+		for (int i=1; i<dev->sciCount; i++) {
+			if (dev->sciQueue[i].priority < dev->sciQueue[next].priority) next = i;
+		}
+		VS1053_SCI_CMD_t cmd = dev->sciQueue[next];
+		memmove(&dev->sciQueue[next], &dev->sciQueue[next+1], (dev->sciCount - next - 1) * sizeof(VS1053_SCI_CMD_t));
+		dev->sciCount--;
+		xSemaphoreGive(dev->sciQueueLock);
+
+		if (cmd.write) {
+			write_register(dev, cmd.reg, cmd.value);
+		} else {
+			*cmd.result = read_register(dev, cmd.reg);
+			xTaskNotifyGive(cmd.task);
+		}
+		done++;
+	}
+	return done;
+}
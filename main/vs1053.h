@@ -35,6 +35,9 @@
 #ifndef MAIN_VS1053_H_
 #define MAIN_VS1053_H_
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "driver/spi_master.h"
 
 // SCI Register
@@ -68,24 +71,126 @@
 #define LOW                 0
 #define HIGH                1
 #define	VS1053_CHUNK_SIZE   32
+#define VS1053_XTALI        12288000    // XTALI frequency
+#define VS1053_SCI_SLOW     200000      // SCI clock until SCI_CLOCKF is programmed
+#define VS1053_CLOCKF       (6 << 12)   // Default SCI_CLOCKF, multiplyer 3.0
+#define VS1053_SDI_FREQ     6000000     // Default SDI clock
+#define VS1053_SDI_QUEUE_SIZE 2                 // Preallocated SDI transactions (double buffered)
 #define _BV(bit) (1 << (bit)) 
 
+#define VS1053_FIFO_SIZE    2048        // SDI FIFO
+#define VS1053_JITTER_BUCKETS 8             // DREQ to burst histogram, <8us, <16us ... >=512us
+#define VS1053_DREQ_TIMEOUT_MS 500          // Longest wait for DREQ before the decoder is taken as stuck
+
+// Stream formats, as reported in SCI_HDAT1
+#define VS1053_FORMAT_NONE  0
+#define VS1053_FORMAT_MP3   1               // MPEG layer I/II/III
+#define VS1053_FORMAT_AAC   2               // AAC ADTS
+#define VS1053_FORMAT_ADIF  3               // AAC ADIF
+#define VS1053_FORMAT_WAV   4
+#define VS1053_FORMAT_WMA   5
+#define VS1053_FORMAT_OGG   6
+#define VS1053_FORMAT_FLAC  7
+#define VS1053_FORMAT_MIDI  8
+#define VS1053_FORMAT_M4A   9               // AAC in MP4
+
+// checkHealth result
+#define VS1053_HEALTH_OK        0
+#define VS1053_HEALTH_UNDERRUN  1           // Too little data was sent to tell
+#define VS1053_HEALTH_STALLED   2           // Data was taken but SCI_DECODE_TIME didn't move
+#define VS1053_HEALTH_FORMAT    3           // Data was taken but no format was recognized
+#define VS1053_HEALTH_BLOCKED   4           // DREQ stayed low, the decoder doesn't take data
+
+// recoverHealth action, cheapest first
+#define VS1053_RECOVER_NONE     0
+#define VS1053_RECOVER_FLUSH    1           // Flush the FIFO with endFillBytes
+#define VS1053_RECOVER_CANCEL   2           // End the stream with SM_CANCEL
+#define VS1053_RECOVER_RESET    3           // softReset and restore the settings
+
+// SCI command queue
+#define VS1053_SCI_QUEUE_SIZE   8
+#define VS1053_PRIO_CONTROL     0           // Volume, tone. Served first.
+#define VS1053_PRIO_TELEMETRY   1           // Register reads for status
+
 typedef struct {
+    uint8_t reg;
+    uint8_t priority;                       // VS1053_PRIO_xxx
+    bool write;
+    uint16_t value;                         // Value to write
+    uint16_t *result;                       // Where a read goes
+    TaskHandle_t task;                      // Task waiting for the read
+} VS1053_SCI_CMD_t;
+
+// stopSongAsync state
+#define VS1053_CANCEL_IDLE  0
+#define VS1053_CANCEL_FLUSH 1               // Sending endFillBytes before SM_CANCEL
+#define VS1053_CANCEL_WAIT  2               // SM_CANCEL set, waiting for it to clear
+
+typedef struct {
+    spi_host_device_t host;                 // SPI bus, one VS1053 per host
     int16_t cs_pin;
     int16_t dcs_pin;
     int16_t dreq_pin;
     int16_t reset_pin;
     uint8_t curvol;                         // Current volume setting 0..100%
+    uint16_t bass;                          // Current SCI_BASS setting
     uint8_t endFillByte;                    // Byte to send when stopping song
     uint8_t chipVersion;                    // Version of hardware
-    spi_device_handle_t SPIHandleLow;
+    SemaphoreHandle_t lock;                 // Serializes SCI and SDI access between tasks
+    uint16_t clockf;                        // Last value written to SCI_CLOCKF
+    int sciFreq;                            // Current SCI clock
+    int sdiFreq;                            // SDI clock
+    spi_device_handle_t SPIHandleSci;       // SCI device, re-created when SCI_CLOCKF changes
     spi_device_handle_t SPIHandleFast;
+    spi_transaction_t sdiTrans[VS1053_SDI_QUEUE_SIZE]; // SDI transaction pool
+    uint8_t *sdiBuffer;                     // DMA-capable burst buffers, one per transaction
+    uint8_t sdiHead;                        // Next transaction to queue
+    uint8_t sdiInFlight;                    // Queued transactions not reaped yet
+    uint32_t sdiBytes;                      // SDI bytes sent since last printSdiStats
+    uint32_t sdiTotalBytes;                 // SDI bytes sent, never cleared
+    int64_t sdiBusyUs;                      // Time spent in the SDI engine since last printSdiStats
+    int64_t sdiStatsStart;                  // Start of the current statistics period
+    TaskHandle_t volatile dreqTask;         // Task waiting for DREQ to rise
+    uint32_t dreqWaits;                     // Number of times the caller had to wait for DREQ
+    uint32_t dreqWakeups;                   // Number of DREQ interrupts that woke the caller
+    int64_t dreqWaitUs;                     // Time spent waiting for DREQ
+    uint32_t dreqTotalWaitUs;               // Time spent waiting for DREQ, never cleared
+    volatile int64_t dreqRiseUs;            // When the DREQ interrupt woke the feeder, 0 if it didn't
+    uint32_t dreqJitter[VS1053_JITTER_BUCKETS]; // DREQ rising to the next SDI burst
+    uint8_t cancelState;                    // VS1053_CANCEL_xxx
+    uint16_t cancelCount;                   // endFillBytes left in the current state
+    int64_t cancelStart;                    // When stopSongAsync was called
+    void (*cancelCallback)(void *arg, bool ok);
+    void *cancelArg;
+    uint32_t streamBytes;                   // Song bytes sent by playChunk
+    uint8_t trackFormat;                    // Format of the track being sent
+    bool trackPending;                      // Decoder hasn't reached the last track boundary
+    uint32_t trackBoundary;                 // streamBytes at the last track boundary
+    uint32_t trackFillBytes;                // endFillBytes inserted at the last track boundary
+    bool trackEnded;                        // A stop ended the last track, nothing sent since
+    uint32_t dreqTimeouts;                  // DREQ waits given up after VS1053_DREQ_TIMEOUT_MS
+    uint32_t healthBytes;                   // streamBytes at the last checkHealth
+    uint32_t healthTimeouts;                // dreqTimeouts at the last checkHealth
+    uint16_t healthDecodeTime;              // SCI_DECODE_TIME at the last checkHealth
+    uint8_t recoverAction;                  // Last recoverHealth action, VS1053_RECOVER_NONE if healthy
+    int64_t recoverStart;                   // When the current failure was found
+    uint32_t recoveries;                    // Number of failures recovered from
+    int64_t recoverUs;                      // Total time to recover
+    TaskHandle_t sciOwner;                  // Task that owns the bus and serves the SCI queue
+    void (*sciNotify)(void *arg);           // Wakes the owner when a command is queued
+    void *sciNotifyArg;
+    SemaphoreHandle_t sciQueueLock;
+    VS1053_SCI_CMD_t sciQueue[VS1053_SCI_QUEUE_SIZE]; // Pending commands, oldest first
+    volatile uint8_t sciCount;              // Number of pending commands
+    uint32_t sciCoalesced;                  // Writes replaced by a later one
 } VS1053_t;
 
 // Private
 void delay(int ms);
-void spi_master_init(VS1053_t * dev, int16_t GPIO_CS, int16_t GPIO_DCS, int16_t GPIO_DREQ, int16_t GPIO_RESET);
+void spi_master_init(VS1053_t * dev, spi_host_device_t host, int16_t GPIO_SCLK, int16_t GPIO_MISO, int16_t GPIO_MOSI,
+	int16_t GPIO_CS, int16_t GPIO_DCS, int16_t GPIO_DREQ, int16_t GPIO_RESET);
 void await_data_request(VS1053_t * dev);
+bool await_data_request_timeout(VS1053_t * dev, TickType_t xTicksToWait);
 bool current_data_request(VS1053_t * dev);
 void control_mode_on(VS1053_t * dev);
 void control_mode_off(VS1053_t * dev);
@@ -95,8 +200,12 @@ uint16_t read_register(VS1053_t * dev, uint8_t _reg);
 bool write_register(VS1053_t * dev, uint8_t _reg, uint16_t _value);
 bool sdi_send_buffer(VS1053_t * dev, uint8_t *data, size_t len);
 bool sdi_send_fillers(VS1053_t * dev, size_t length);
+void sdi_wait_idle(VS1053_t * dev);
 void wram_write(VS1053_t * dev, uint16_t address, uint16_t data);
 uint16_t wram_read(VS1053_t * dev, uint16_t address);
+bool sci_write_multiple(VS1053_t * dev, uint8_t _reg, const uint16_t *values, uint16_t fill, size_t n);
+bool wram_write_block(VS1053_t * dev, uint16_t address, const uint16_t *data, size_t n);
+bool wram_read_block(VS1053_t * dev, uint16_t address, uint16_t *data, size_t n);
 
 // public
 void startSong(VS1053_t * dev);                             // Prepare to start playing. Call this each
@@ -105,8 +214,18 @@ void playChunk(VS1053_t * dev, uint8_t *data, size_t len);  // Play a chunk of d
                                                             // the chip.  Blocks until complete.
 void stopSong(VS1053_t * dev);                              // Finish playing a song. Call this after
                                                             // the last playChunk call.
+void stopSongAsync(VS1053_t * dev, void (*callback)(void *arg, bool ok), void *arg);
+                                                            // Same as stopSong, but returns at once.
+bool stopSongStep(VS1053_t * dev);                          // Advance stopSongAsync. Call this while
+                                                            // no data is played. true while stopping.
+bool startTrack(VS1053_t * dev, uint8_t format);            // Mark a track boundary. Tracks that can be
+                                                            // concatenated are played without a gap.
+                                                            // false while a stop is running.
+bool trackChanged(VS1053_t * dev);                          // true once the decoder has reached the
+                                                            // last track boundary.
+uint8_t getDecodedFormat(VS1053_t * dev);                   // Format being decoded (SCI_HDAT1)
 void setVolume(VS1053_t * dev, uint8_t vol);                // Set the player volume.Level from 0-100,
-                                                            // higher is louder.
+                                                            // higher is louder. Queued from other tasks.
 void setTone(VS1053_t * dev, uint8_t *rtone);               // Set the player baas/treble, 4 nibbles for
                                                             // treble gain/freq and bass gain/freq
 uint8_t getVolume(VS1053_t * dev);                          // Get the currenet volume setting.
@@ -120,6 +239,21 @@ uint16_t getDecodedTime(VS1053_t * dev);                    // Provides SCI_DECO
 
 void clearDecodedTime(VS1053_t * dev);                      // Clears SCI_DECODE_TIME register (sets 0x00)
 uint8_t getHardwareVersion(VS1053_t * dev);
+bool loadUserCode(VS1053_t * dev, const uint16_t *plugin, size_t len); // Load a VLSI plugin/patch (.plg table)
+void printSdiStats(VS1053_t * dev);                         // Print SDI throughput and DREQ waits since the last call
+uint8_t checkHealth(VS1053_t * dev);                        // Check the decoder makes progress. Call this
+                                                            // every few seconds while playing.
+uint8_t recoverHealth(VS1053_t * dev, uint8_t health);      // Recover from a failed checkHealth, escalating
+                                                            // on each call. Returns the action taken.
+void sciSetOwner(VS1053_t * dev, void (*notify)(void *arg), void *arg);
+                                                            // Make the calling task the bus owner. Other tasks
+                                                            // queue their SCI commands to it.
+bool sciQueueWrite(VS1053_t * dev, uint8_t reg, uint16_t value, uint8_t priority);
+                                                            // Queue a register write. A pending write to the
+                                                            // same register is replaced.
+bool sciQueueRead(VS1053_t * dev, uint8_t reg, uint16_t *value, uint8_t priority, TickType_t xTicksToWait);
+                                                            // Read a register through the queue. Blocks.
+int sciService(VS1053_t * dev, int max);                    // Bus owner: run up to max queued commands
 
 #endif /* MAIN_VS1053_H_ */
 
@@ -0,0 +1,32 @@
+import select, socket, struct, time
+
+# Decode the stats packets of CONFIG_STATS_BROADCAST
+PORT = 9877
+HEADER = struct.Struct('<IIIHBBIIIIIIIIIB')
+TASK = struct.Struct('<12sH')
+MAGIC = 0x31535356
+
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(('<broadcast>', PORT))
+s.setblocking(0)
+
+while True:
+	result = select.select([s],[],[])
+	rbuf, address = result[0][0].recvfrom(1024)
+	if len(rbuf) < HEADER.size:
+		continue
+	(magic, sequence, uptime, period, station, fill, bufferMs, sdiBytes, dreqWaitMs,
+		underruns, reconnects, heapFree, heapMin, psramFree, psramMin, taskCount) = HEADER.unpack_from(rbuf)
+	if magic != MAGIC:
+		continue
+	print("{} {} #{} up {}s station={} buffer={}% {}ms sdi={}B/s dreq={}ms/{}ms underruns={} reconnects={}".format(
+		time.strftime('%H:%M:%S'), address[0], sequence, uptime, station, fill, bufferMs,
+		sdiBytes, dreqWaitMs, period, underruns, reconnects))
+	print("  heap free={} min={} psram free={} min={}".format(heapFree, heapMin, psramFree, psramMin))
+	tasks = []
+	for i in range(taskCount):
+		name, cpu = TASK.unpack_from(rbuf, HEADER.size + i * TASK.size)
+		tasks.append("{}={:.1f}%".format(name.split(b'\0')[0].decode('utf-8'), cpu / 10))
+	if tasks:
+		print("  cpu " + " ".join(tasks))
@@ -0,0 +1,15 @@
+/* Host stub of esp_heap_caps.h */
+
+#ifndef TEST_HOST_ESP_HEAP_CAPS_H_
+#define TEST_HOST_ESP_HEAP_CAPS_H_
+
+#include <stdlib.h>
+
+#define MALLOC_CAP_DMA      (1 << 3)
+#define MALLOC_CAP_8BIT     (1 << 2)
+#define MALLOC_CAP_SPIRAM   (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+#define heap_caps_malloc(size, caps) malloc(size)
+
+#endif /* TEST_HOST_ESP_HEAP_CAPS_H_ */
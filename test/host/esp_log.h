@@ -0,0 +1,14 @@
+/* Host stub of esp_log.h for the host tests */
+
+#ifndef TEST_HOST_ESP_LOG_H_
+#define TEST_HOST_ESP_LOG_H_
+
+// Takes the arguments, so they don't show up as unused
+static inline void esp_log_unused(const char *tag, ...) { (void)tag; }
+
+#define ESP_LOGE(tag, format, ...) esp_log_unused(tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) esp_log_unused(tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) esp_log_unused(tag, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) esp_log_unused(tag, ##__VA_ARGS__)
+
+#endif /* TEST_HOST_ESP_LOG_H_ */
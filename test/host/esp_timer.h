@@ -0,0 +1,15 @@
+/* Host stub of esp_timer.h */
+
+#ifndef TEST_HOST_ESP_TIMER_H_
+#define TEST_HOST_ESP_TIMER_H_
+
+#include <stdint.h>
+#include <time.h>
+
+static inline int64_t esp_timer_get_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+#endif /* TEST_HOST_ESP_TIMER_H_ */
@@ -0,0 +1,28 @@
+/* Host stub of the FreeRTOS parts used by the host tests.
+   A tick is 1 ms and a binary semaphore is a pthread condition. */
+
+#ifndef TEST_HOST_FREERTOS_H_
+#define TEST_HOST_FREERTOS_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+
+#define pdTRUE              1
+#define pdFALSE             0
+#define portMAX_DELAY       ((TickType_t)0xffffffff)
+#define configASSERT(x)     assert(x)
+
+static inline TickType_t xTaskGetTickCount(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+#endif /* TEST_HOST_FREERTOS_H_ */
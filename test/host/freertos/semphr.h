@@ -0,0 +1,58 @@
+/* Host stub of freertos/semphr.h: binary semaphores only */
+
+#ifndef TEST_HOST_SEMPHR_H_
+#define TEST_HOST_SEMPHR_H_
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool given;
+} HOST_SEMAPHORE_t;
+
+typedef HOST_SEMAPHORE_t * SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+	SemaphoreHandle_t semaphore = calloc(1, sizeof(HOST_SEMAPHORE_t));
+	if (semaphore == NULL) return NULL;
+	pthread_mutex_init(&semaphore->mutex, NULL);
+	pthread_cond_init(&semaphore->cond, NULL);
+	return semaphore;
+}
+
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+	pthread_mutex_lock(&semaphore->mutex);
+	BaseType_t ret = semaphore->given ? pdFALSE : pdTRUE;
+	semaphore->given = true;
+	pthread_cond_signal(&semaphore->cond);
+	pthread_mutex_unlock(&semaphore->mutex);
+	return ret;
+}
+
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	if (ticksToWait != portMAX_DELAY) {
+		deadline.tv_sec += ticksToWait / 1000;
+		deadline.tv_nsec += (ticksToWait % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+	pthread_mutex_lock(&semaphore->mutex);
+	while (!semaphore->given) {
+		if (ticksToWait == portMAX_DELAY) {
+			pthread_cond_wait(&semaphore->cond, &semaphore->mutex);
+		} else if (pthread_cond_timedwait(&semaphore->cond, &semaphore->mutex, &deadline) != 0) {
+			break;
+		}
+	}
+	BaseType_t ret = semaphore->given ? pdTRUE : pdFALSE;
+	semaphore->given = false;
+	pthread_mutex_unlock(&semaphore->mutex);
+	return ret;
+}
+
+#endif /* TEST_HOST_SEMPHR_H_ */
@@ -0,0 +1,30 @@
+/* Host stub of freertos/task.h */
+
+#ifndef TEST_HOST_TASK_H_
+#define TEST_HOST_TASK_H_
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct {
+	TickType_t start;
+} TimeOut_t;
+
+static inline void vTaskSetTimeOutState(TimeOut_t * timeOut) {
+	timeOut->start = xTaskGetTickCount();
+}
+
+// Counts *ticksToWait down to what is left, like the FreeRTOS one
+static inline BaseType_t xTaskCheckForTimeOut(TimeOut_t * timeOut, TickType_t * ticksToWait) {
+	if (*ticksToWait == portMAX_DELAY) return pdFALSE;
+	TickType_t now = xTaskGetTickCount();
+	TickType_t elapsed = now - timeOut->start;
+	if (elapsed >= *ticksToWait) {
+		*ticksToWait = 0;
+		return pdTRUE;
+	}
+	*ticksToWait -= elapsed;
+	timeOut->start = now;
+	return pdFALSE;
+}
+
+#endif /* TEST_HOST_TASK_H_ */
@@ -0,0 +1,10 @@
+#!/bin/sh
+# Build and run the host tests with gcc. Run from the repository root.
+set -e
+out=${TMPDIR:-/tmp}
+gcc -Wall -I test/host -I main -o $out/test_audio_frame test/host/test_audio_frame.c
+$out/test_audio_frame
+gcc -O2 -Wall -I test/host -I main -o $out/test_http_stream test/host/test_http_stream.c main/http_stream.c
+$out/test_http_stream
+gcc -O2 -Wall -pthread -I test/host -I main -o $out/test_audio_ring test/host/test_audio_ring.c main/audio_ring.c
+$out/test_audio_ring
@@ -0,0 +1,190 @@
+/* Host test of the frame parser and of the gap between tracks
+
+   gcc -Wall -I test/host -I main -o test_audio_frame test/host/test_audio_frame.c && ./test_audio_frame
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// audio_frame.c only needs the format numbers from vs1053.h
+#define MAIN_VS1053_H_
+#define VS1053_FORMAT_NONE  0
+#define VS1053_FORMAT_MP3   1
+#define VS1053_FORMAT_AAC   2
+#include "audio_frame.c"
+
+#define MP3_FRAME_LENGTH 417                // MPEG-1 Layer III 128 kbit/s 44100 Hz
+#define AAC_FRAME_LENGTH 371                // ADTS AAC LC 44100 Hz stereo
+#define CANCEL_FILL_BYTES 2052              // endFillBytes of stopSongAsync() before SM_CANCEL
+#define SDI_BURST 32
+
+static int failures = 0;
+
+#define CHECK(expr) do { if (!(expr)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #expr); failures++; } } while (0)
+
+static size_t add_mp3_frames(uint8_t *stream, size_t length, int count) {
+	for (int i=0; i<count; i++) {
+		static const uint8_t header[] = { 0xFF, 0xFB, 0x90, 0x64 };
+		memset(&stream[length], 0, MP3_FRAME_LENGTH);
+		memcpy(&stream[length], header, sizeof(header));
+		length += MP3_FRAME_LENGTH;
+	}
+	return length;
+}
+
+static size_t add_aac_frames(uint8_t *stream, size_t length, int count) {
+	for (int i=0; i<count; i++) {
+		uint8_t header[] = { 0xFF, 0xF1, 0x50, 0x80 | (AAC_FRAME_LENGTH >> 11),
+			(AAC_FRAME_LENGTH >> 3) & 0xFF, ((AAC_FRAME_LENGTH & 7) << 5) | 0x1F, 0xFC };
+		memset(&stream[length], 0, AAC_FRAME_LENGTH);
+		memcpy(&stream[length], header, sizeof(header));
+		length += AAC_FRAME_LENGTH;
+	}
+	return length;
+}
+
+static size_t add_frames(uint8_t *stream, size_t length, uint8_t format, int count) {
+	if (format == VS1053_FORMAT_MP3) return add_mp3_frames(stream, length, count);
+	return add_aac_frames(stream, length, count);
+}
+
+// Feed stream in blocks of blockSize, and collect what would be sent to the VS1053
+static size_t feed(AUDIO_FRAME_t * frame, const uint8_t *stream, size_t length, size_t blockSize, uint8_t *out) {
+	uint8_t block[blockSize + FRAME_HEADER_SIZE];
+	size_t outLength = 0;
+	for (size_t i=0; i<length; i+=blockSize) {
+		size_t n = (length - i < blockSize) ? length - i : blockSize;
+		memcpy(block, &stream[i], n);
+		n = frameParse(frame, block, n, sizeof(block));
+		memcpy(&out[outLength], block, n);
+		outLength += n;
+	}
+	return outLength;
+}
+
+// An ADTS header in front of MP3 frames must not lock the stream to AAC
+static void test_false_sync(void) {
+	static const uint8_t adts[] = { 0xFF, 0xF1, 0x50, 0x80, 0x02, 0x1F, 0xFC };
+	uint8_t *stream = malloc(sizeof(adts) + 300 * MP3_FRAME_LENGTH);
+	uint8_t *out = malloc(sizeof(adts) + 300 * MP3_FRAME_LENGTH);
+	memcpy(stream, adts, sizeof(adts));
+	size_t length = add_mp3_frames(stream, sizeof(adts), 300);
+
+	AUDIO_FRAME_t frame;
+	frameReset(&frame);
+	size_t outLength = feed(&frame, stream, length, 1460, out);
+	printf("false sync: format=%d frames=%"PRIu32" junk=%"PRIu32"\n", frame.format, frame.frames, frame.junk);
+	CHECK(frame.format == VS1053_FORMAT_MP3);
+	// The MP3 frame under the ADTS frame is lost, the next one confirms the one after it
+	CHECK(frame.frames == 298);
+	CHECK(frame.junk == sizeof(adts) + 2 * MP3_FRAME_LENGTH);
+	CHECK(outLength == length - frame.junk);
+	CHECK(memcmp(out, &stream[frame.junk], outLength) == 0);
+	free(stream);
+	free(out);
+}
+
+// All junk is dropped even when the header bytes span blocks
+static void test_small_blocks(void) {
+	uint8_t *stream = malloc(60 + 10 * MP3_FRAME_LENGTH);
+	uint8_t *out = malloc(60 + 10 * MP3_FRAME_LENGTH);
+	for (int i=0; i<60; i++) stream[i] = (i % 7 == 0) ? 0xFF : i;
+	size_t length = add_mp3_frames(stream, 60, 10);
+
+	AUDIO_FRAME_t frame;
+	frameReset(&frame);
+	size_t outLength = feed(&frame, stream, length, 1, out);
+	printf("small blocks: format=%d frames=%"PRIu32" junk=%"PRIu32"\n", frame.format, frame.frames, frame.junk);
+	CHECK(frame.format == VS1053_FORMAT_MP3);
+	CHECK(frame.frames == 9);
+	CHECK(frame.junk == 60 + MP3_FRAME_LENGTH);
+	CHECK(outLength == length - frame.junk);
+	CHECK(memcmp(out, &stream[frame.junk], outLength) == 0);
+	free(stream);
+	free(out);
+}
+
+// The decoder is simulated by the frame parser fed in SDI bursts: it follows
+// the stream from header to header, doesn't take a header of another format
+// while in sync, and starts over after SM_CANCEL.
+static void sdi_decode(AUDIO_FRAME_t * frame, const uint8_t *data, size_t length) {
+	uint8_t burst[SDI_BURST + FRAME_HEADER_SIZE];
+	for (size_t i=0; i<length; i+=SDI_BURST) {
+		size_t n = (length - i < SDI_BURST) ? length - i : SDI_BURST;
+		memcpy(burst, &data[i], n);
+		frameParse(frame, burst, n, sizeof(burst));
+	}
+}
+
+// Track b follows track a the way startTrack() sends it when cancel is
+// !frameConcatenable(): back to back, or after the endFillBytes of
+// stopSongAsync(). Returns the bytes between the last frame of a and the
+// first decoded frame of b, and the number of frames of b decoded.
+static size_t track_gap(uint8_t a, uint8_t b, bool cancel, uint32_t *framesB) {
+	uint8_t *stream = malloc(20 * MP3_FRAME_LENGTH);
+	AUDIO_FRAME_t frame;
+	frameReset(&frame);
+	sdi_decode(&frame, stream, add_frames(stream, 0, a, 20));
+	uint32_t framesA = frame.frames;
+	uint32_t junkA = frame.junk;
+	size_t fill = 0;
+	if (cancel) {
+		fill = CANCEL_FILL_BYTES;
+		memset(stream, 0, fill); // endFillByte is 0 for MP3 and AAC
+		sdi_decode(&frame, stream, fill);
+		// SM_CANCEL has cleared, the decoder starts over
+		frameReset(&frame);
+		framesA = 0;
+		junkA = 0;
+	}
+	sdi_decode(&frame, stream, add_frames(stream, 0, b, 20));
+	free(stream);
+	*framesB = frame.frames - framesA;
+	return fill + frame.junk - junkA;
+}
+
+// Same-format MP3 and ADTS tracks play back to back with no byte in between.
+// A format change needs the SM_CANCEL sequence: without it the decoder stays
+// on the old format.
+static void test_track_gap(void) {
+	static const char *name[] = { "none", "MP3", "AAC" };
+	static const uint8_t pairs[][2] = {
+		{ VS1053_FORMAT_MP3, VS1053_FORMAT_MP3 },
+		{ VS1053_FORMAT_AAC, VS1053_FORMAT_AAC },
+		{ VS1053_FORMAT_MP3, VS1053_FORMAT_AAC },
+		{ VS1053_FORMAT_AAC, VS1053_FORMAT_MP3 },
+	};
+	for (int i=0; i<sizeof(pairs)/sizeof(pairs[0]); i++) {
+		uint8_t a = pairs[i][0];
+		uint8_t b = pairs[i][1];
+		bool cancel = !frameConcatenable(a, b);
+		uint32_t framesB;
+		size_t gap = track_gap(a, b, cancel, &framesB);
+		printf("track gap: %s -> %s %zu bytes, %"PRIu32" of 20 frames\n", name[a], name[b], gap, framesB);
+		if (!cancel) {
+			CHECK(gap == 0);
+			CHECK(framesB == 20);
+		} else {
+			// The first frame after the cancel is only trusted once the next one follows
+			CHECK(gap == CANCEL_FILL_BYTES + ((b == VS1053_FORMAT_MP3) ? MP3_FRAME_LENGTH : AAC_FRAME_LENGTH));
+			CHECK(framesB == 19);
+			// Back to back, the new format isn't decoded
+			track_gap(a, b, false, &framesB);
+			CHECK(framesB == 0);
+		}
+	}
+}
+
+int main(void) {
+	test_false_sync();
+	test_small_blocks();
+	test_track_gap();
+	printf("%s\n", failures ? "FAIL" : "OK");
+	return failures ? 1 : 0;
+}
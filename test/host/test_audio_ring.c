@@ -0,0 +1,276 @@
+/* Host test of the SPSC audio ring
+
+   gcc -O2 -Wall -pthread -I test/host -I main -o test_audio_ring test/host/test_audio_ring.c main/audio_ring.c && ./test_audio_ring
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "audio_ring.h"
+
+// Not a power of two, like the default 100 KB
+#define RING_SIZE 5000
+
+// Start the byte counters this far below SIZE_MAX, so they wrap during the test
+#define RING_START_BELOW 20000
+
+static int failures = 0;
+
+#define CHECK(expr) do { if (!(expr)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #expr); failures++; } } while (0)
+
+static void ring_init(AUDIO_RING_t * ring) {
+	CHECK(ringInit(ring, RING_SIZE, 0));
+	atomic_store(&ring->head, SIZE_MAX - RING_START_BELOW);
+	atomic_store(&ring->tail, SIZE_MAX - RING_START_BELOW);
+}
+
+static void ring_free(AUDIO_RING_t * ring) {
+	free(ring->buffer);
+	free(ring->spaceReady);
+	free(ring->dataReady);
+}
+
+// Byte n of the stream. 251 is prime, so the pattern doesn't line up with RING_SIZE.
+static uint8_t stream_byte(size_t n) {
+	return n % 251;
+}
+
+// Write up to length bytes of the stream at head. Returns the bytes written.
+static size_t ring_put(AUDIO_RING_t * ring, size_t *written, size_t length) {
+	uint8_t *span;
+	size_t spanLength = ringWriteSpan(ring, &span);
+	CHECK(span >= ring->buffer && span + spanLength <= ring->buffer + ring->size);
+	CHECK(spanLength <= ring->size - ringFill(ring));
+	if (length > spanLength) length = spanLength;
+	for (size_t i=0; i<length; i++) span[i] = stream_byte(*written + i);
+	ringCommit(ring, length);
+	*written += length;
+	return length;
+}
+
+// Read up to length bytes at tail and check them. Returns the bytes read.
+static size_t ring_get(AUDIO_RING_t * ring, size_t *read, size_t length) {
+	uint8_t *span;
+	size_t spanLength = ringReadSpan(ring, &span);
+	CHECK(span >= ring->buffer && span + spanLength <= ring->buffer + ring->size);
+	CHECK(spanLength <= ringFill(ring));
+	if (length > spanLength) length = spanLength;
+	size_t bad = 0;
+	for (size_t i=0; i<length; i++) {
+		if (span[i] != stream_byte(*read + i)) bad++;
+	}
+	CHECK(bad == 0);
+	ringRelease(ring, length);
+	*read += length;
+	return length;
+}
+
+// Spans end at the end of the buffer and continue at its start,
+// also when the head and tail counters wrap around SIZE_MAX.
+static void test_ring_wrap(void) {
+	AUDIO_RING_t ring;
+	ring_init(&ring);
+	size_t written = 0;
+	size_t read = 0;
+	size_t wraps = 0;
+	for (int i=0; written < 20 * RING_SIZE; i++) {
+		uint8_t *span;
+		size_t writeOffset = ringWriteSpan(&ring, &span) ? span - ring.buffer : 0;
+		ring_put(&ring, &written, 1 + (i * 7919) % 1500);
+		if (ringWriteSpan(&ring, &span) && span == ring.buffer && writeOffset) wraps++;
+		ring_get(&ring, &read, 1 + (i * 104729) % 1300);
+		CHECK(ringFill(&ring) == written - read);
+	}
+	while (ringFill(&ring)) ring_get(&ring, &read, RING_SIZE);
+	CHECK(read == written);
+	CHECK(wraps > 0);
+	CHECK(atomic_load(&ring.head) < SIZE_MAX - RING_START_BELOW);
+	printf("ring wrap: %zu bytes, %zu wraps\n", written, wraps);
+	ring_free(&ring);
+}
+
+// The consumer may read data committed after a ringDiscard() before it
+// sees the discard. The discard must then drop nothing more.
+static void test_ring_discard(void) {
+	AUDIO_RING_t ring;
+	ring_init(&ring);
+	size_t written = 0;
+	size_t read = 0;
+	uint8_t *span;
+
+	// Between the consumer's ringCheckDiscard() and ringReadSpan()
+	ring_put(&ring, &written, 100);
+	CHECK(ringCheckDiscard(&ring) == false);
+	ringDiscard(&ring);
+	ring_put(&ring, &written, 50);
+	ring_get(&ring, &read, 150);
+	CHECK(ringCheckDiscard(&ring) == true);
+	CHECK(ringFill(&ring) == 0);
+	CHECK(ringReadSpan(&ring, &span) == 0);
+
+	// Only the data before the discard is dropped
+	ring_put(&ring, &written, 100);
+	ringDiscard(&ring);
+	size_t discarded = written;
+	ring_put(&ring, &written, 30);
+	CHECK(ringCheckDiscard(&ring) == true);
+	CHECK(ringFill(&ring) == 30);
+	read = discarded;
+	ring_get(&ring, &read, 30);
+	CHECK(ringFill(&ring) == 0);
+
+	// Two discards before the consumer looks
+	ring_put(&ring, &written, 100);
+	ringDiscard(&ring);
+	ring_put(&ring, &written, 100);
+	ringDiscard(&ring);
+	discarded = written;
+	ring_put(&ring, &written, 20);
+	CHECK(ringCheckDiscard(&ring) == true);
+	CHECK(ringCheckDiscard(&ring) == false);
+	CHECK(ringFill(&ring) == 20);
+	read = discarded;
+	ring_get(&ring, &read, 20);
+	ring_free(&ring);
+}
+
+#define STRESS_BYTES (16 * 1024 * 1024)
+#define DISCARD_EPOCHS 20000
+
+typedef struct {
+	AUDIO_RING_t ring;
+	atomic_bool done;
+	size_t read;
+} STRESS_t;
+
+static void *stress_producer(void *arg) {
+	STRESS_t *stress = arg;
+	size_t written = 0;
+	unsigned seed = 1;
+	while (written < STRESS_BYTES) {
+		CHECK(ringWaitSpace(&stress->ring));
+		size_t length = 1 + rand_r(&seed) % 2000;
+		if (length > STRESS_BYTES - written) length = STRESS_BYTES - written;
+		ring_put(&stress->ring, &written, length);
+	}
+	atomic_store(&stress->done, true);
+	ringWake(&stress->ring);
+	return NULL;
+}
+
+static void *stress_consumer(void *arg) {
+	STRESS_t *stress = arg;
+	unsigned seed = 2;
+	while (1) {
+		if (!ringWaitData(&stress->ring, 1, 100)) {
+			if (atomic_load(&stress->done) && ringFill(&stress->ring) == 0) break;
+			continue;
+		}
+		ring_get(&stress->ring, &stress->read, 1 + rand_r(&seed) % 1500);
+	}
+	return NULL;
+}
+
+// A producer and a consumer thread through the watermark waits
+static void test_ring_stress(void) {
+	STRESS_t stress;
+	ring_init(&stress.ring);
+	atomic_init(&stress.done, false);
+	stress.read = 0;
+	pthread_t producer, consumer;
+	pthread_create(&consumer, NULL, stress_consumer, &stress);
+	pthread_create(&producer, NULL, stress_producer, &stress);
+	pthread_join(producer, NULL);
+	pthread_join(consumer, NULL);
+	printf("ring stress: %zu bytes, %"PRIu32" producer waits\n", stress.read, stress.ring.producerWaits);
+	CHECK(stress.read == STRESS_BYTES);
+	ring_free(&stress.ring);
+}
+
+// Each epoch is a run of bytes with the epoch number, followed by a
+// ringDiscard(). The consumer must never see an older epoch again.
+static void *discard_producer(void *arg) {
+	STRESS_t *stress = arg;
+	unsigned seed = 3;
+	for (int epoch=1; epoch<=DISCARD_EPOCHS; epoch++) {
+		if (epoch > 1) ringDiscard(&stress->ring);
+		size_t length = 200 + rand_r(&seed) % 400;
+		while (length) {
+			CHECK(ringWaitSpace(&stress->ring));
+			uint8_t *span;
+			size_t spanLength = ringWriteSpan(&stress->ring, &span);
+			if (spanLength > length) spanLength = length;
+			memset(span, epoch % 256, spanLength);
+			ringCommit(&stress->ring, spanLength);
+			length -= spanLength;
+		}
+	}
+	atomic_store(&stress->done, true);
+	ringWake(&stress->ring);
+	return NULL;
+}
+
+static void *discard_consumer(void *arg) {
+	STRESS_t *stress = arg;
+	unsigned seed = 4;
+	int epoch = 1;
+	while (1) {
+		ringCheckDiscard(&stress->ring);
+		CHECK(ringFill(&stress->ring) <= stress->ring.size);
+		if (!ringWaitData(&stress->ring, 1, 100)) {
+			if (atomic_load(&stress->done) && ringFill(&stress->ring) == 0 && !ringCheckDiscard(&stress->ring)) break;
+			continue;
+		}
+		uint8_t *span;
+		size_t length = ringReadSpan(&stress->ring, &span);
+		size_t maxLength = 1 + rand_r(&seed) % 700;
+		if (length > maxLength) length = maxLength;
+		for (size_t i=0; i<length; i++) {
+			// Epochs wrap at 256, and the consumer is never 128 epochs behind
+			int8_t ahead = span[i] - epoch % 256;
+			if (ahead < 0) {
+				CHECK(ahead >= 0);
+				return NULL;
+			}
+			epoch += ahead;
+		}
+		ringRelease(&stress->ring, length);
+		stress->read += length;
+	}
+	CHECK(epoch == DISCARD_EPOCHS);
+	return NULL;
+}
+
+// ringDiscard() from the producer racing ringCheckDiscard() in the consumer
+static void test_ring_discard_race(void) {
+	STRESS_t stress;
+	ring_init(&stress.ring);
+	atomic_init(&stress.done, false);
+	stress.read = 0;
+	pthread_t producer, consumer;
+	pthread_create(&consumer, NULL, discard_consumer, &stress);
+	pthread_create(&producer, NULL, discard_producer, &stress);
+	pthread_join(producer, NULL);
+	pthread_join(consumer, NULL);
+	printf("ring discard race: %d epochs, %zu bytes read\n", DISCARD_EPOCHS, stress.read);
+	ring_free(&stress.ring);
+}
+
+int main(void) {
+	test_ring_wrap();
+	test_ring_discard();
+	test_ring_stress();
+	test_ring_discard_race();
+	printf("%s\n", failures ? "FAIL" : "OK");
+	return failures ? 1 : 0;
+}
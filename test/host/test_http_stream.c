@@ -0,0 +1,239 @@
+/* Host test of the HTTP stream body decoding and the ICY metadata split
+
+   gcc -O2 -Wall -I test/host -I main -o test_http_stream test/host/test_http_stream.c main/http_stream.c && ./test_http_stream
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http_stream.h"
+
+static int failures = 0;
+
+#define CHECK(expr) do { if (!(expr)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #expr); failures++; } } while (0)
+
+static void chunked_reset(METADATA_t * hoge, char *recvBuffer, size_t recvSize) {
+	memset(hoge, 0, sizeof(METADATA_t));
+	hoge->chunked = true;
+	hoge->chunkState = CHUNK_SIZE;
+	hoge->recvBuffer = recvBuffer;
+	hoge->recvSize = recvSize;
+}
+
+// Feed body in blocks of blockSize like recv() would, and collect the payload.
+// Returns the payload length, or -1 if the last chunk wasn't seen.
+static int chunked_feed(const char *body, size_t length, size_t blockSize, char *out) {
+	char recvBuffer[blockSize];
+	METADATA_t hoge;
+	chunked_reset(&hoge, recvBuffer, blockSize);
+	int outLength = 0;
+	for (size_t i=0; i<length; i+=blockSize) {
+		size_t n = (length - i < blockSize) ? length - i : blockSize;
+		memcpy(recvBuffer, &body[i], n);
+		int read_len = decodeChunked(&hoge, n);
+		if (read_len < 0) break;
+		memcpy(&out[outLength], recvBuffer, read_len);
+		outLength += read_len;
+	}
+	return (hoge.chunkState == CHUNK_DONE) ? outLength : -1;
+}
+
+// Chunk-size lines, extensions and the trailer may be split anywhere
+static void test_chunked_split(void) {
+	static const char body[] =
+		"4;name=value\r\nWiki\r\n"
+		"5\r\npedia\r\n"
+		"1a\r\n in\r\n\r\nchunks, hex size 1a\r\n"
+		"0;last\r\nTrailer: x\r\n\r\n";
+	static const char payload[] = "Wikipedia in\r\n\r\nchunks, hex size 1a";
+	size_t length = strlen(body);
+	char out[sizeof(body)];
+
+	for (size_t blockSize=1; blockSize<=length; blockSize++) {
+		int outLength = chunked_feed(body, length, blockSize, out);
+		CHECK(outLength == strlen(payload));
+		CHECK(outLength >= 0 && memcmp(out, payload, outLength) == 0);
+	}
+
+	// The last chunk alone in a block is reported as the end
+	char recvBuffer[64];
+	METADATA_t hoge;
+	chunked_reset(&hoge, recvBuffer, sizeof(recvBuffer));
+	strcpy(recvBuffer, "0\r\n\r\n");
+	CHECK(decodeChunked(&hoge, 5) == -1);
+}
+
+#define ICY_METAINT 16
+
+// metaint bytes of audio, then a length byte and length*16 bytes of metadata
+static size_t icy_add(char *stream, size_t length, const char *audio, const char *title) {
+	memcpy(&stream[length], audio, ICY_METAINT);
+	length += ICY_METAINT;
+	size_t titleLength = strlen(title);
+	size_t blocks = (titleLength + 15) / 16;
+	stream[length++] = blocks;
+	memset(&stream[length], 0, blocks * 16);
+	memcpy(&stream[length], title, titleLength);
+	return length + blocks * 16;
+}
+
+// Feed stream to icyDemux() in the given receive blocks like recv() would.
+// The stream data is collected in out and the metadata in titles, one per line.
+static size_t icy_feed(const char *stream, const size_t *blocks, int blockCount, size_t bufferSize, char *out, char *titles) {
+	char recvBuffer[256];
+	char streamdata[bufferSize];
+	METADATA_t hoge;
+	memset(&hoge, 0, sizeof(METADATA_t));
+	hoge.metaintSize = ICY_METAINT;
+	hoge.recvBuffer = recvBuffer;
+	hoge.recvSize = sizeof(recvBuffer);
+	hoge.streamdata = streamdata;
+	hoge.bufferSize = bufferSize;
+	size_t outLength = 0;
+	titles[0] = 0;
+	for (int i=0; i<blockCount; i++) {
+		memcpy(recvBuffer, stream, blocks[i]);
+		stream += blocks[i];
+		hoge.recvLength = blocks[i];
+		hoge.recvIndex = 0;
+		while (1) {
+			int type = icyDemux(&hoge);
+			if (type == NEEDDATA) break;
+			if (type == METADATA) {
+				strcat(titles, hoge.metadata);
+				strcat(titles, "\n");
+			} else if (type == STREAMDATA) {
+				memcpy(&out[outLength], streamdata, hoge.streamdataSize);
+				outLength += hoge.streamdataSize;
+				hoge.streamdataSize = 0;
+			} else {
+				CHECK(type == METADATA || type == STREAMDATA || type == NEEDDATA);
+				break;
+			}
+		}
+	}
+	free(hoge.metadata);
+	return outLength;
+}
+
+// The metaint boundary, the length byte and the metadata may each land in a different block
+static void test_icy_split(void) {
+	static const char audio[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ@#";
+	static const char title1[] = "StreamTitle='Artist - Title';";     // 2 blocks
+	static const char title2[] = "StreamTitle='';";                   // 1 block
+	char stream[256];
+	size_t length = 0;
+	length = icy_add(stream, length, &audio[0], title1);
+	length = icy_add(stream, length, &audio[16], "");                 // length byte 0
+	length = icy_add(stream, length, &audio[32], title2);
+	memcpy(&stream[length], &audio[48], 10);
+	length += 10;
+	const char expectTitles[] = "StreamTitle='Artist - Title';\nStreamTitle='';\n";
+	char out[256];
+	char titles[256];
+
+	// Every fixed block size, with streamdata smaller and larger than metaint
+	for (size_t bufferSize=5; bufferSize<=64; bufferSize+=59) {
+		for (size_t blockSize=1; blockSize<=length; blockSize++) {
+			size_t blocks[256];
+			int blockCount = 0;
+			for (size_t i=0; i<length; i+=blockSize) blocks[blockCount++] = (length - i < blockSize) ? length - i : blockSize;
+			size_t outLength = icy_feed(stream, blocks, blockCount, bufferSize, out, titles);
+			CHECK(outLength == 58);
+			CHECK(memcmp(out, audio, 58) == 0);
+			CHECK(strcmp(titles, expectTitles) == 0);
+		}
+	}
+
+	// The block ends at metaint, the length byte comes alone, and the metadata is
+	// split in two: 16 | 1 | 20 | 12 | 16 | 1 | ...
+	size_t blocks[] = { 16, 1, 20, 12, 16, 1, 16, 1, 10, 6, 10 };
+	size_t total = 0;
+	for (size_t i=0; i<sizeof(blocks)/sizeof(blocks[0]); i++) total += blocks[i];
+	CHECK(total == length);
+	size_t outLength = icy_feed(stream, blocks, sizeof(blocks)/sizeof(blocks[0]), 64, out, titles);
+	CHECK(outLength == 58);
+	CHECK(memcmp(out, audio, 58) == 0);
+	CHECK(strcmp(titles, expectTitles) == 0);
+}
+
+// The chunked path before decodeChunked(): one byte per read(), one strtol() per hex digit
+static size_t old_chunked(const char *body, size_t length, char *out) {
+	size_t outLength = 0;
+	size_t chunkCount = 0;
+	size_t chunkSize = 0;
+	char buffer[2];
+	for (size_t i=0; i<length; i++) {
+		buffer[0] = body[i];
+		if (chunkCount == 0) {
+			if (buffer[0] == 0x0D) {
+			} else if (buffer[0] == 0x0A) {
+				chunkCount = chunkSize;
+				chunkSize = 0;
+			} else {
+				buffer[1] = 0;
+				long byte = strtol(buffer, NULL, 16);
+				chunkSize = (chunkSize << 4) + byte;
+			}
+		} else {
+			chunkCount--;
+			out[outLength++] = buffer[0];
+		}
+	}
+	return outLength;
+}
+
+static double elapsed_ns(struct timespec *start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+// 4 MB in 8 KB chunks, received in 4 KB blocks like MAX_HTTP_BLOCK_SIZE.
+// The old path also made one read() call per byte, which isn't counted here.
+static void bench_chunked(void) {
+	const size_t payloadLength = 4 * 1024 * 1024;
+	const size_t chunkLength = 8192;
+	const size_t blockSize = 4096;
+	char *body = malloc(payloadLength + payloadLength / chunkLength * 16 + 16);
+	char *out = malloc(payloadLength);
+	size_t length = 0;
+	for (size_t i=0; i<payloadLength; i+=chunkLength) {
+		length += sprintf(&body[length], "%zx\r\n", chunkLength);
+		for (size_t j=0; j<chunkLength; j++) body[length++] = (i + j) * 7;
+		length += sprintf(&body[length], "\r\n");
+	}
+	length += sprintf(&body[length], "0\r\n\r\n");
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size_t oldLength = old_chunked(body, length, out);
+	double oldNs = elapsed_ns(&start);
+	CHECK(oldLength == payloadLength);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int newLength = chunked_feed(body, length, blockSize, out);
+	double newNs = elapsed_ns(&start);
+	CHECK(newLength == payloadLength);
+
+	printf("chunked: old %.2f ns/byte, decodeChunked %.2f ns/byte (%.1fx)\n",
+		oldNs / length, newNs / length, oldNs / newNs);
+	free(body);
+	free(out);
+}
+
+int main(void) {
+	test_chunked_split();
+	test_icy_split();
+	bench_chunked();
+	printf("%s\n", failures ? "FAIL" : "OK");
+	return failures ? 1 : 0;
+}